@@ -0,0 +1,115 @@
+/* C++ header file for the Arena class.
+ * An arena hands out memory by bumping a pointer through large chunks,
+ * and gives it all back at once with release(). The AST is allocated
+ * this way: nodes are never freed one at a time, so each compilation
+ * drops its whole tree in one operation once code has been generated.
+ */
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+using namespace std;
+
+class Arena {
+  private:
+    static const size_t CHUNK = 64 * 1024;
+
+    vector<char*> chunks; // the first is kept across releases
+    size_t firstSize;
+    char* next;
+    char* end;
+
+    // What keep() has made permanent: the chunks before keptChunks, and
+    // the one after that up to keptNext.
+    size_t keptChunks;
+    size_t keptReserved;
+    char* keptNext;
+    char* keptEnd;
+
+    // Starts a new chunk with room for at least size bytes.
+    void refill(size_t size) {
+      size_t bytes = size > CHUNK ? size : CHUNK;
+      char* chunk = (char*)malloc(bytes);
+      if (!chunk) throw bad_alloc();
+      if (chunks.empty()) firstSize = bytes;
+      chunks.push_back(chunk);
+      next = chunk;
+      end = chunk + bytes;
+      reserved += bytes;
+    }
+
+  public:
+    // Statistics, for reporting how the front end uses memory.
+    size_t allocations; // since the arena was made
+    size_t bytes;       // requested since the arena was made
+    size_t reserved;    // currently held from malloc
+    size_t peak;        // largest value reserved has had
+
+    Arena() :firstSize(0), next(NULL), end(NULL),
+      keptChunks(0), keptReserved(0), keptNext(NULL), keptEnd(NULL),
+      allocations(0), bytes(0), reserved(0), peak(0) { }
+    ~Arena() {
+      for (char* c : chunks) free(c);
+    }
+
+    // Returns size bytes aligned for any AST node (pointers, ints).
+    void* allocate(size_t size, size_t align = sizeof(void*)) {
+      char* p = (char*)(((size_t)next + align - 1) & ~(align - 1));
+      if (!next || p + size > end) {
+        refill(size + align);
+        p = (char*)(((size_t)next + align - 1) & ~(align - 1));
+      }
+      next = p + size;
+      ++allocations;
+      bytes += size;
+      if (reserved > peak) peak = reserved;
+      return p;
+    }
+
+    // Copies a string into the arena, with a terminating NUL.
+    const char* copy(const char* s, size_t len) {
+      char* p = (char*)allocate(len + 1, 1);
+      memcpy(p, s, len);
+      p[len] = '\0';
+      return p;
+    }
+
+    // Frees everything allocated since the last keep(), keeping one
+    // chunk for reuse.
+    void release() {
+      if (keptNext) {
+        for (size_t i = keptChunks + 1; i < chunks.size(); ++i) free(chunks[i]);
+        chunks.resize(keptChunks + 1);
+        next = keptNext;
+        end = keptEnd;
+        reserved = keptReserved;
+      }
+      else if (!chunks.empty()) {
+        for (size_t i = 1; i < chunks.size(); ++i) free(chunks[i]);
+        chunks.resize(1);
+        next = chunks[0];
+        end = chunks[0] + firstSize;
+        reserved = firstSize;
+      }
+    }
+
+    // Makes everything allocated so far permanent: release() will no
+    // longer free it. (The interpreter keeps function definitions so.)
+    void keep() {
+      if (chunks.empty()) return;
+      keptChunks = chunks.size() - 1;
+      keptReserved = reserved;
+      keptNext = next;
+      keptEnd = end;
+    }
+
+  private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
+#endif // ARENA_HPP
@@ -6,66 +6,112 @@
 
 #include "ast.hpp"
 #include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <typeinfo>
 
 /* Adds this node and all children to the output stream in DOT format. 
  * nextnode is the index of the next node to add. */
-void AST::addToDot(ostream& out, int& nextnode) {
+void AST::addToDot(ostream& out, int& nextnode, const Profiler* heat) {
   int root = nextnode;
   ++nextnode;
-  out << "\tn" << root << " [label=\"" << nodeLabel << "\"];" << endl;
+  out << "\tn" << root << " [label=\"";
+  writeLabel(out);
+  const profileCount* c = heat ? heat->find(this) : NULL;
+  if (heat && line) out << "\\nline " << line;
+  if (c) {
+    // Shades from white, for none of the time, to red for all of it.
+    char buf[100];
+    double h = heat->heat(*c);
+    snprintf(buf, sizeof buf, "\\n%lu runs, %.1f%%\", style=filled, "
+             "fillcolor=\"0.000 %.3f 1.000", c->runs, 100 * h, h);
+    out << buf;
+  }
+  out << "\"];" << endl;
+  vector<AST*> children;
+  getChildren(children);
   for (int i=0; i < children.size(); ++i) {
+    if (!children[i]) continue;
     int child = nextnode;
-    children[i]->addToDot(out, nextnode);
+    children[i]->addToDot(out, nextnode, heat);
     out << "\tn" << root << " -> n" << child << ";" << endl;
   }
 }
 
 /* Writes this AST to a .dot file as named. */
 void AST::writeDot(const char* fname) {
+  writeDot(fname, vector<AST*>(1, this), NULL);
+}
+
+void AST::writeDot(const char* fname, const vector<AST*>& trees,
+                   const Profiler* heat) {
   ofstream fout(fname);
   int nodes = 1;
   fout << "digraph AST {" << endl;
-  addToDot (fout, nodes);
+  for (AST* tree : trees) tree->addToDot(fout, nodes, heat);
   fout << "}" << endl;
   fout.close();
 }
 
+/* Counts this node and all below it, by class. The tree is walked with
+ * a stack of its own, since a long statement list is as deep as it is
+ * long. */
+void AST::countNodes(map<type_index, unsigned long>& counts) {
+  vector<AST*> nodes;
+  listNodes(nodes);
+  for (AST* node : nodes) ++counts[node->nodeClass()];
+}
+
+void AST::listNodes(vector<AST*>& nodes) {
+  vector<AST*> todo(1, this), kids;
+  while (!todo.empty()) {
+    AST* node = todo.back();
+    todo.pop_back();
+    nodes.push_back(node);
+    kids.clear();
+    node->getChildren(kids);
+    // getChildren() keeps the NULLs, which addToDot() skips too.
+    for (auto k = kids.rbegin(); k != kids.rend(); ++k) {
+      if (*k) todo.push_back(*k);
+    }
+  }
+}
+
 // ArithOp constructor
 ArithOp::ArithOp(Exp* l, Oper o, Exp* r) { 
   op = o;
   left = l;
   right = r;
-  nodeLabel = "Exp:ArithOp:";
+}
+
+void ArithOp::writeLabel(ostream& out) {
+  out << "Exp:ArithOp:";
+  switch(op) {
+    case ADD: out << '+'; break;
+    case SUB: out << '-'; break;
+    case MUL: out << '*'; break;
+    case DIV: out << '/'; break;
+    case MOD: out << '%'; break;
+    default:  out << "ERROR";
+  }
+}
+
+ArithOp* ArithOp::make(Exp* l, Oper o, Exp* r) {
   switch(o) {
-    case ADD: nodeLabel += '+'; break;
-    case SUB: nodeLabel += '-'; break;
-    case MUL: nodeLabel += '*'; break;
-    case DIV: nodeLabel += '/'; break;
-    case MOD: nodeLabel += '%'; break;
-    default:  nodeLabel += "ERROR";
+    case ADD: return new FixedArith<ADD>(l, r);
+    case SUB: return new FixedArith<SUB>(l, r);
+    case MUL: return new FixedArith<MUL>(l, r);
+    case DIV: return new FixedArith<DIV>(l, r);
+    case MOD: return new FixedArith<MOD>(l, r);
+    default:  return new ArithOp(l, o, r);
   }
-  ASTchild(left);
-  ASTchild(right);
 }
 
 // Evaluates an arithmetic operation
 Value ArithOp::eval() {
-  int l = left->eval().num();
-  int r = right->eval().num();
-  switch(op) {
-    case ADD: return l + r;
-    case SUB: return l - r;
-    case MUL: return l * r;
-    case DIV: 
-      if (r != 0) return l / r;
-      else if (!error) {
-        error = true;
-        errout << "ERROR: Divide by zero" << endl;
-      }
-      return Value();
-    case MOD: return l % r;
-    default:  return Value(); // shouldn't get here...
-  }
+  int l = left->evalNum();
+  int r = right->evalNum();
+  return apply(op, l, r);
 }
 
 void ArithOp::evalCode(codeGenContext& ctx) {
@@ -88,12 +134,41 @@ void ArithOp::evalCode(codeGenContext& ctx) {
             break;
         default:
             errout << "Unimplemented operator\n";
-            exit(1);
+            state().error = true;
     }
 }
 
+void ArithOp::evalBC(Bytecode& bc) {
+    left->evalBC(bc);
+    right->evalBC(bc);
+    switch(op) {
+        case ADD: bc.emit(ADDOP); break;
+        case SUB: bc.emit(SUBOP); break;
+        case MUL: bc.emit(MULOP); break;
+        case DIV: bc.emit(DIVOP); break;
+        case MOD: bc.emit(MODOP); break;
+        default:  Exp::evalBC(bc);
+    }
+}
+
+VType ArithOp::evalJit(jitContext& ctx) {
+    if (left->evalJit(ctx) == NONE_T) return NONE_T;
+    ctx.pushValue();
+    if (right->evalJit(ctx) == NONE_T) return NONE_T;
+    ctx.popOperands();
+    switch(op) {
+        case ADD: ctx.add(); break;
+        case SUB: ctx.sub(); break;
+        case MUL: ctx.mul(); break;
+        case DIV: ctx.div(false); break;
+        case MOD: ctx.div(true); break;
+        default:  return NONE_T;
+    }
+    return NUM_T;
+}
+
 Value NegOp::eval() {
-  return -(right->eval().num());
+  return evalNum();
 }
 
 // Constructor for CompOp
@@ -101,33 +176,47 @@ CompOp::CompOp(Exp* l, Oper o, Exp* r) {
   op = o;
   left = l;
   right = r;
-  nodeLabel = "Exp:CompOp:";
-  switch(o) {
-    case LT: nodeLabel += "<";  break;
-    case GT: nodeLabel += ">";  break;
-    case LE: nodeLabel += "<="; break;
-    case GE: nodeLabel += ">="; break;
-    case EQ: nodeLabel += "=";  break;
-    case NE: nodeLabel += "!="; break;
-    default: nodeLabel += "ERROR"; break;
+}
+
+void CompOp::writeLabel(ostream& out) {
+  out << "Exp:CompOp:";
+  switch(op) {
+    case LT: out << "<";  break;
+    case GT: out << ">";  break;
+    case LE: out << "<="; break;
+    case GE: out << ">="; break;
+    case EQ: out << "=";  break;
+    case NE: out << "!="; break;
+    default: out << "ERROR"; break;
   }
-  ASTchild(left);
-  ASTchild(right);
 }
 
-Value CompOp::eval() {
-  int lhs = left->eval().num();
-  int rhs = right->eval().num();
-  switch (op) {
-    case LT: return lhs < rhs;
-    case GT: return lhs > rhs;
-    case LE: return lhs <= rhs;
-    case GE: return lhs >= rhs;
-    case EQ: return lhs == rhs;
-    case NE: return lhs != rhs;
-    default: break;
+// Makes a FixedComp, or a VarConstComp if it compares a variable with
+// a number.
+template <Oper O>
+static CompOp* specialize(Exp* l, Exp* r) {
+  Id* var = dynamic_cast<Id*>(l);
+  Num* num = dynamic_cast<Num*>(r);
+  if (var && num) return new VarConstComp<O>(var, num);
+  return new FixedComp<O>(l, r);
+}
+
+CompOp* CompOp::make(Exp* l, Oper o, Exp* r) {
+  switch (o) {
+    case LT: return specialize<LT>(l, r);
+    case GT: return specialize<GT>(l, r);
+    case LE: return specialize<LE>(l, r);
+    case GE: return specialize<GE>(l, r);
+    case EQ: return specialize<EQ>(l, r);
+    case NE: return specialize<NE>(l, r);
+    default: return new CompOp(l, o, r);
   }
-  return false;
+}
+
+Value CompOp::eval() {
+  int l = left->evalNum();
+  int r = right->evalNum();
+  return apply(op, l, r);
 }
 
 void CompOp::evalCode(codeGenContext& ctx) {
@@ -146,10 +235,41 @@ void CompOp::evalCode(codeGenContext& ctx) {
         case NE: ctx.code.push_back("setne cl"); break;
         default:
             errout << "Unimplemented operator\n";
-            exit(1);
+            state().error = true;
     }
     ctx.code.push_back("mov eax, ecx");
 }
+
+void CompOp::evalBC(Bytecode& bc) {
+    left->evalBC(bc);
+    right->evalBC(bc);
+    switch (op) {
+        case LT: bc.emit(LTOP); break;
+        case GT: bc.emit(GTOP); break;
+        case LE: bc.emit(LEOP); break;
+        case GE: bc.emit(GEOP); break;
+        case EQ: bc.emit(EQOP); break;
+        case NE: bc.emit(NEOP); break;
+        default: Exp::evalBC(bc);
+    }
+}
+
+VType CompOp::evalJit(jitContext& ctx) {
+    if (left->evalJit(ctx) == NONE_T) return NONE_T;
+    ctx.pushValue();
+    if (right->evalJit(ctx) == NONE_T) return NONE_T;
+    ctx.popOperands();
+    switch (op) {
+        case LT: ctx.compare(JIT_LT); break;
+        case GT: ctx.compare(JIT_GT); break;
+        case LE: ctx.compare(JIT_LE); break;
+        case GE: ctx.compare(JIT_GE); break;
+        case EQ: ctx.compare(JIT_EQ); break;
+        case NE: ctx.compare(JIT_NE); break;
+        default: return NONE_T;
+    }
+    return BOOL_T;
+}
     
 
 // Constructor for BoolOp
@@ -157,98 +277,370 @@ BoolOp::BoolOp(Exp* l, Oper o, Exp* r) {
   op = o;
   left = l;
   right = r;
-  nodeLabel = "Exp:BoolOp:";
-  if (o == AND) nodeLabel += "and";
-  else nodeLabel += "or";
-  ASTchild(left);
-  ASTchild(right);
 }
 
-Value BoolOp::eval() {
-  switch (op) {
-      case AND: return left->eval().tf() && right->eval().tf();
-      case OR:  return left->eval().tf() || right->eval().tf();
-      default: break;
+BoolOp* BoolOp::make(Exp* l, Oper o, Exp* r) {
+  switch (o) {
+      case AND: return new FixedBool<AND>(l, r);
+      case OR:  return new FixedBool<OR>(l, r);
+      default:  return new BoolOp(l, o, r);
   }
-  return false;
+}
+
+Value BoolOp::eval() {
+  if (op == AND) return left->evalBool() && right->evalBool();
+  else return left->evalBool() || right->evalBool();
+}
+
+// Makes eax 1 if it isn't 0, unless it is a boolean, which already is.
+static void truthCode(Exp* e, codeGenContext& ctx) {
+    if (e->getType() == BOOL_T) return;
+    ctx.code.push_back("neg eax");
+    ctx.code.push_back("sbb eax, eax");
+    ctx.code.push_back("neg eax");
 }
 
 void BoolOp::evalCode(codeGenContext& ctx) {
     left->evalCode(ctx);
+    truthCode(left, ctx);
     ctx.code.push_back("test eax, eax");
     ctx.code.push_back("jz/jnz DUMMY");
     unsigned placeHold = ctx.code.size() - 1;
     right->evalCode(ctx);
+    truthCode(right, ctx);
     ctx.labels.push_back(ctx.code.size());
     ctx.code[placeHold] = (op == AND ? "jz " : "jnz ") + ctx.getLabel(ctx.code.size());
 }
 
+// The right side is only evaluated if it decides the result.
+void BoolOp::evalBC(Bytecode& bc) {
+    left->evalBC(bc);
+    bc.emit(op == AND ? ANDJ : ORJ, 0);
+    int toEnd = bc.here() - 1;
+    right->evalBC(bc);
+    bc.emit(TRUTH);
+    bc.patch(toEnd);
+}
+
+// Both sides must be booleans, which are always 0 or 1 in eax.
+VType BoolOp::evalJit(jitContext& ctx) {
+    if (left->evalJit(ctx) != BOOL_T) return NONE_T;
+    int toEnd = ctx.newLabel();
+    ctx.jumpIf(op == OR, toEnd);
+    if (right->evalJit(ctx) != BOOL_T) return NONE_T;
+    ctx.place(toEnd);
+    return BOOL_T;
+}
+
+
+// Once a variable has been given values of two different types, it
+// has no type.
+void typeContext::assign(Id* decl, VType t) {
+    if (decl->getType() != NONE_T && decl->getType() != t) {
+        decl->setType(NONE_T);
+        changed = true;
+    }
+}
+
+// Goes through the statement again until no variable's type changes,
+// so that uses before an assignment (in a loop) see what it assigns.
+// The globals it declares keep their types for the statements after it.
+void inferTypes(Stmt* tree) {
+    for (bool first = true; ; first = false) {
+        typeContext ctx(NULL, first);
+        tree->inferTypes(ctx);
+        if (ctx.changed) continue;
+        symbolMap<VType>& globalTypes = state().globalTypes;
+        for (Id* var : ctx.globals) {
+            VType* t = globalTypes.find(var->getSym());
+            if (!t) globalTypes[var->getSym()] = var->getType();
+            else if (*t != var->getType()) *t = NONE_T;
+        }
+        break;
+    }
+}
+
+// A variable has the type of its declaration, if it is in scope. Outside
+// of functions, a global from an earlier statement has the type it has
+// had so far, unless a function can assign to it. A function can be
+// called after the global has changed, so there it has no type.
+VType Id::inferType(typeContext& ctx) {
+    if (Id** decl = ctx.scope.lookup(slot)) return (*decl)->getType();
+    splContext& spl = state();
+    VType* t = ctx.fun ? NULL : spl.globalTypes.find(val);
+    if (!t || (slot < spl.assignedInFuns.size() && spl.assignedInFuns[slot])) {
+        return NONE_T;
+    }
+    return *t;
+}
+
+void Write::exec() {
+    Value res;
+    switch (val->getType()) {
+        case NUM_T:  res = Value(val->evalNum()); break;
+        case BOOL_T: res = Value(val->evalBool()); break;
+        default:     res = val->eval(); break;
+    }
+    if (!state().error) {
+        res.writeTo(resout);
+        if (newline) resout << '\n';
+    }
+}
 
-// Appends b to the end of a and returns the result.
-Stmt* Stmt::append(Stmt* a, Stmt* b) {
-  if (! a->hasNext()) return b;
-  Stmt* last = a;
-  while (last->getNext()->hasNext()) last = last->getNext();
-  last->setNext(b);
-  return a;
+// Compiled code only knows how to write a value from its type. One with
+// no known type is written as a number, unless it could be an array.
+void Write::execCode(codeGenContext& ctx) {
+    VType type = val->getType();
+    if (type == NONE_T) {
+        codeGenContext* global_scope = ctx.parent ? ctx.parent : &ctx;
+        if (global_scope->madeArrays) {
+            errout << "ERROR: Can't tell whether this writes an array\n";
+            state().error = true;
+            return;
+        }
+        global_scope->untypedWrites = true;
+    }
+    val->evalCode(ctx);
+    if (type == BOOL_T) ctx.code.push_back("call writebool");
+    else if (type == ARR_T) ctx.code.push_back("call writearray");
+    else ctx.code.push_back("call write");
+    if (newline) ctx.code.push_back("call writelf");
 }
 
-// Default constructor for Stmt.
-// This HAS to be declared here because it uses NullStmt, which
-// hasn't been defined yet in the header file!
-Stmt::Stmt() {
-  next = new NullStmt();
-  children.push_back(next);
+// Appends s to the end of list.
+void Stmt::append(StmtList& list, Stmt* s) {
+  if (list.tail) list.tail->setNext(s);
+  else list.head = s;
+  list.tail = s;
+  while (list.tail->hasNext()) list.tail = list.tail->getNext();
 }
 
-std::map<std::string, Value> varmap;
+thread_local splContext* splContext::current = NULL;
 
 void NewStmt::exec() {
-    if (varmap.find(lhs->getVal()) != varmap.end()) {
-        error = true;
-        std::cerr << "ERROR: Variable already bound\n";
+    SymbolTable<Value>& vars = state().scope();
+    if (vars.boundHere(lhs->getSlot())) {
+        state().error = true;
+        errout << "ERROR: Variable already bound\n";
     }
     else {
-        varmap[lhs->getVal()] = rhs->eval();
+        Value val = rhs->eval();
+        vars.bind(lhs->getSlot(), val);
     }
 }
 
+// A variable declared here gets the type of its first value. No
+// function may assign to it, unless it is the function's own.
+void NewStmt::inferTypes(typeContext& ctx) {
+    VType type = rhs->infer(ctx);
+    int slot = lhs->getSlot();
+    if (ctx.scope.boundHere(slot)) return; // an error when it runs
+    vector<bool>& assignedInFuns = state().assignedInFuns;
+    if (!ctx.fun && slot < assignedInFuns.size() && assignedInFuns[slot]) {
+        type = NONE_T;
+    }
+    if (ctx.firstPass) lhs->setType(type);
+    else ctx.assign(lhs, type);
+    if (!ctx.fun && ctx.scope.global()) ctx.globals.push_back(lhs);
+    ctx.scope.bind(slot, lhs);
+}
+
 void NewStmt::execCode(codeGenContext& ctx) {
     rhs->evalCode(ctx);
-    if (ctx.hasIdentifier(lhs->getVal())) {
+    if (ctx.identifiers.boundHere(lhs->getSym())) {
         errout << "ERROR: Variable already bound\n";
-        exit(1);
+        state().error = true;
+        return;
     }
-    ctx.addIdentifier(lhs->getVal());
-    ctx.code.push_back("mov [" + ctx.getAsmID(lhs->getVal()) + "], eax");
+    ctx.addIdentifier(lhs->getSym());
+    ctx.code.push_back("mov [" + ctx.getAsmID(lhs->getSym()) + "], eax");
+}
+
+// As in exec(), the check comes before the right side is evaluated.
+void NewStmt::execBC(Bytecode& bc) {
+    int slot = lhs->getSlot();
+    bc.emit(NEWVAR, slot, 0);
+    int toEnd = bc.here() - 1;
+    rhs->evalBC(bc);
+    bc.emit(BINDVAR, slot);
+    bc.patch(toEnd);
 }
 
-void Asn::exec() {
-    if (varmap.find(lhs->getVal()) == varmap.end()) {
-        error = true;
-        std::cerr << "ERROR: Can't rebind; not yet bound!\n";
+// Variables of compiled code are made in its own frame, so the
+// interpreter's scopes never change while it runs.
+bool NewStmt::execJit(jitContext& ctx) {
+    if (!ctx.blocks || ctx.scope.boundHere(lhs->getSlot())) return false;
+    VType type = rhs->evalJit(ctx);
+    if (type == NONE_T) return false;
+    ctx.store(ctx.declare(lhs->getSlot(), type));
+    return true;
+}
+
+// Makes an IncAsn if it adds a number to the variable or subtracts one
+// from it, or else a general Asn.
+Asn* Asn::make(Id* l, Exp* r) {
+    ArithOp* a = dynamic_cast<ArithOp*>(r);
+    Id* var = a ? dynamic_cast<Id*>(a->getLeft()) : NULL;
+    if (var && var->getSlot() == l->getSlot()
+        && (a->getOp() == ADD || a->getOp() == SUB)
+        && dynamic_cast<Num*>(a->getRight())) {
+        return new IncAsn(l, a);
+    }
+    return new Asn(l, r);
+}
+
+void Asn::assign() {
+    splContext& spl = state();
+    if (!spl.lookup(lhs->getSlot())) {
+        spl.error = true;
+        errout << "ERROR: Can't rebind; not yet bound!\n";
     }
     else {
-        varmap[lhs->getVal()] = rhs->eval();
+        Value val = rhs->eval();
+        *spl.lookup(lhs->getSlot()) = val;
+    }
+}
+
+void Asn::inferTypes(typeContext& ctx) {
+    VType type = rhs->infer(ctx);
+    int slot = lhs->getSlot();
+    if (Id** decl = ctx.scope.lookup(slot)) ctx.assign(*decl, type);
+    else if (ctx.fun) {
+        // Whichever variable this turns out to be, its type can't be
+        // known anywhere else.
+        vector<bool>& assignedInFuns = state().assignedInFuns;
+        if (slot >= assignedInFuns.size()) assignedInFuns.resize(slot + 1);
+        if (!assignedInFuns[slot]) {
+            assignedInFuns[slot] = true;
+            ctx.changed = true;
+        }
+    }
+    else if (VType* t = state().globalTypes.find(lhs->getSym())) {
+        // A global declared by an earlier statement
+        if (*t != NONE_T && *t != type) {
+            *t = NONE_T;
+            ctx.changed = true;
+        }
     }
 }
 
 void Asn::execCode(codeGenContext& ctx) {
     rhs->evalCode(ctx);
-    if (!ctx.hasIdentifier(lhs->getVal())) {
+    if (!ctx.hasIdentifier(lhs->getSym())) {
         errout << "ERROR: Undefined variable\n";
-        exit(1);
+        state().error = true;
+        return;
+    }
+    ctx.code.push_back("mov [" + ctx.getAsmID(lhs->getSym()) + "], eax");
+}
+
+void Asn::execBC(Bytecode& bc) {
+    int slot = lhs->getSlot();
+    bc.emit(SETVAR, slot, 0);
+    int toEnd = bc.here() - 1;
+    rhs->evalBC(bc);
+    bc.emit(STORE, slot);
+    bc.patch(toEnd);
+}
+
+// A variable never changes type in compiled code.
+bool Asn::execJit(jitContext& ctx) {
+    jitVar var;
+    if (!ctx.lookup(lhs->getSlot(), var)) return false;
+    if (rhs->evalJit(ctx) != var.type) return false;
+    ctx.store(var);
+    return true;
+}
+
+Value NewArray::make(int n) {
+    if (n < 0 || n > MAX_ARRAY) {
+        if (!state().error) {
+            state().error = true;
+            errout << (n < 0 ? "ERROR: Negative array size"
+                             : "ERROR: Array too large") << endl;
+        }
+        return Value();
+    }
+    int* a = (int*)state().heap.allocate(sizeof(int) * (n + 1), sizeof(int));
+    a[0] = n;
+    memset(a + 1, 0, sizeof(int) * n);
+    return Value(a);
+}
+
+// Anything written before now with no known type was written as a
+// number, which this array could turn out to be.
+void NewArray::evalCode(codeGenContext& ctx) {
+    codeGenContext* global_scope = ctx.parent ? ctx.parent : &ctx;
+    if (global_scope->untypedWrites) {
+        errout << "ERROR: A value written before this array is made could be an array\n";
+        state().error = true;
+        return;
+    }
+    global_scope->madeArrays = true;
+    size->evalCode(ctx);
+    ctx.code.push_back("call newarray");
+}
+
+// A negative index is out of bounds too, compared unsigned.
+int* Index::element(Value& a, int i) {
+    const char* error;
+    if (a.getType() != ARR_T) error = "ERROR: Not an array";
+    else if ((unsigned)i >= (unsigned)a.arr()[0]) {
+        error = "ERROR: Array index out of bounds";
+    }
+    else return a.arr() + 1 + i;
+    if (!state().error) {
+        state().error = true;
+        errout << error << endl;
+    }
+    return NULL;
+}
+
+Value Length::of(Value& a) {
+    if (a.getType() == ARR_T) return a.arr()[0];
+    if (!state().error) {
+        state().error = true;
+        errout << "ERROR: Not an array" << endl;
     }
-    ctx.code.push_back("mov [" + ctx.getAsmID(lhs->getVal()) + "], eax");
+    return Value();
+}
+
+// Checks the index in ecx against the length of the array at eax,
+// unless the access is known to be in bounds. libspl's boundserror
+// reports it and exits.
+static void checkBounds(codeGenContext& ctx, AST* access) {
+    if (ctx.unchecked.count(access)) return;
+    ctx.code.push_back("cmp ecx, [eax]");
+    ctx.code.push_back("jae boundserror");
+}
+
+void Index::evalCode(codeGenContext& ctx) {
+    index->evalCode(ctx);
+    ctx.code.push_back("mov ecx, eax");
+    arr->evalCode(ctx);
+    checkBounds(ctx, this);
+    ctx.code.push_back("mov eax, [eax + 4*ecx + 4]");
+}
+
+void IndexAsn::execCode(codeGenContext& ctx) {
+    index->evalCode(ctx);
+    ctx.code.push_back("push eax");
+    rhs->evalCode(ctx);
+    ctx.code.push_back("pop ecx");
+    ctx.code.push_back("mov edx, eax");
+    arr->evalCode(ctx);
+    checkBounds(ctx, this);
+    ctx.code.push_back("mov [eax + 4*ecx + 4], edx");
 }
 
 Value Id::eval() {
-    if (varmap.find(val) == varmap.end()) {
-        error = true;
-        std::cerr << "ERROR: Can't reference, not yet bound!\n";
+    Value* v = state().lookup(slot);
+    if (!v) {
+        state().error = true;
+        errout << "ERROR: Can't reference, not yet bound!\n";
         return Value(0);
     }
-    return varmap[val];
+    return *v;
 }
 
 //from http://stackoverflow.com/questions/874134
@@ -257,19 +649,231 @@ inline bool ends_with(std::string const & value, std::string const & ending) {
     return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
-void codeGenContext::generateCode(const char* fname_c) {
-    code.push_back("call exit");
-    string fname(fname_c);
-    if (ends_with(fname, ".spl")) {
-        auto it = fname.rbegin();
-        *(it++) = 'm';
-        *(it++) = 's';
-        *(it++) = 'a';
+string outputName(const string& src, const char* ext) {
+    if (ends_with(src, ".spl")) {
+        return src.substr(0, src.size()-4) + ext;
+    }
+    return src + ext;
+}
+
+void codeGenContext::startCode(const char* fname) {
+    if (fname) {
+        bodyName = outputName(fname, ".asm.part");
+        body = new fstream(bodyName.c_str(), ios::in | ios::out | ios::trunc);
     }
     else {
-        fname += ".asm";
+        body = new stringstream();
+    }
+}
+
+// Writes out code lines from first on, with their labels, and clears them.
+// With -g, each line is preceded by the source line it came from, when
+// that changes. Other code may have been written out in between, so the
+// first line always has it.
+void codeGenContext::writeCode(ostream& out, unsigned first) {
+    compileStats* stats = state().stats;
+    const string& file = (parent ? parent : this)->sourceName;
+    for (unsigned i = first; i < code.size(); ++i) {
+        if (!labels.empty() && labels.front() == i) {
+            out << getLabel(i) << ":\n";
+            if (stats) ++stats->labels;
+        }
+        while (!labels.empty() && labels.front() == i) labels.pop_front();
+        unsigned line = i == first ? lineWritten : 0;
+        while (!lines.empty() && lines.front().first <= i) {
+            line = lines.front().second;
+            lines.pop_front();
+        }
+        if (line && (line != lineWritten || i == first)) {
+            out << "%line " << line << "+0 " << file << '\n';
+            lineWritten = line;
+        }
+        out << '\t' << code[i] << '\n';
+    }
+    lines.clear();
+    // Labels just past the end, e.g. after a trailing if statement
+    if (!labels.empty()) {
+        out << getLabel(code.size()) << ":\n";
+        if (stats) ++stats->labels;
+    }
+    labels.clear();
+    codeBase += code.size();
+    code.clear();
+}
+
+// Switches the output to the named section, unless it is already there.
+// The attributes are only written where the section is first used.
+void codeGenContext::setSection(const string& name, const char* attrs) {
+    if (section == name) return;
+    section = name;
+    *body << "\nsection " << name;
+    if (sectionsUsed.insert(name).second) *body << attrs;
+    *body << '\n';
+}
+
+// The attributes of sections of code other than .text.
+static const char* TEXT_ATTRS = " progbits alloc exec nowrite align=16";
+
+void codeGenContext::numberCounters(AST* tree) {
+    firstCounter.clear(); // the last statement's nodes are gone
+    vector<AST*> nodes;
+    tree->listNodes(nodes);
+    for (AST* node : nodes) {
+        if (unsigned n = node->numCounters()) {
+            firstCounter[node] = numCounters;
+            numCounters += n;
+        }
     }
+}
+
+// Each counter is 64 bits, so that it can't wrap around.
+void codeGenContext::count(unsigned c) {
+    codeGenContext* global_scope = parent ? parent : this;
+    if (!global_scope->instrument) return;
+    ostringstream os;
+    os << "add dword [SPLPROF_COUNTS + " << c*8 << "], 1";
+    code.push_back(os.str());
+    os.str("");
+    os << "adc dword [SPLPROF_COUNTS + " << c*8 + 4 << "], 0";
+    code.push_back(os.str());
+}
+
+// The statement is generated where it is, in its own scope, but into
+// code and labels of its own, which are then kept aside in cold.
+string codeGenContext::outline(Stmt* s, const string& back) {
+    codeGenContext* global_scope = parent ? parent : this;
+    ostringstream tag;
+    tag << 'c' << global_scope->numOutlined++ << '_';
+    vector<string> hotCode;
+    deque<unsigned> hotLabels;
+    deque<pair<unsigned, unsigned> > hotLines;
+    hotCode.swap(code);
+    hotLabels.swap(labels);
+    hotLines.swap(lines);
+    unsigned hotWritten = lineWritten;
+    lineWritten = 0;
+    if (!hotLines.empty()) markLine(hotLines.back().second);
+    unsigned hotBase = codeBase;
+    string hotTag = labelTag;
+    codeBase = 0;
+    labelTag = tag.str();
+
+    labels.push_back(0);
+    string start = getLabel(0);
+    s->execCode(*this);
+    code.push_back("jmp " + back);
+    ostringstream out;
+    writeCode(out, 0);
+    cold += out.str();
+
+    code.swap(hotCode);
+    labels.swap(hotLabels);
+    lines.swap(hotLines);
+    lineWritten = hotWritten;
+    codeBase = hotBase;
+    labelTag = hotTag;
+    return start;
+}
+
+void codeGenContext::flushFunctions() {
+    ostream& out = *body;
+    if (!literals.empty()) {
+        setSection(".rodata");
+        for (unsigned i = 0; i < literals.size(); ++i) {
+            out << getLitID(numlits - literals.size() + i)
+                << ": db `" << literals[i] << "\\0`\n";
+        }
+        literals.clear();
+    }
+    if (!newids.empty()) {
+        setSection(".bss");
+        for (const string& id : newids) {
+            out << id << ": resb 4\n";
+        }
+        newids.clear();
+    }
+    if (!children.empty()) {
+        for (int i = 0; i < children.size(); ++i) {
+            const char* text = children[i].textSection;
+            setSection(text, strcmp(text, ".text") ? TEXT_ATTRS : "");
+            if (compileStats* stats = state().stats) {
+                // All but the name, and with the return below
+                stats->functions.push_back(make_pair(children[i].code[0],
+                                           children[i].code.size() - 1 + 3));
+            }
+            // The size lets profilers tell where each function ends.
+            const string& name = children[i].code[0];
+            out << '\n' << "global " << name << ":function ("
+                << name << ".end - " << name << ")\n";
+            out << name << ":\n";
+            children[i].writeCode(out, 1);
+            out << ".RET:\n";
+            out << "\tmov esp, ebp\n";
+            out << "\tpop ebp\n";
+            out << "\tret\n";
+            out << children[i].cold;
+            out << ".end:\n";
+        }
+        children.clear();
+    }
+}
+
+void codeGenContext::flushCode() {
+    flushFunctions();
+    if (code.empty()) return;
+    // Top-level code goes in its own section so that it stays in one
+    // piece while functions are written out in between.
+    setSection(".text.start", TEXT_ATTRS);
+    if (!hasEntry) {
+        *body << "_start:\n";
+        if (instrument) {
+            // Tells libspl's exit where every module's counters are.
+            *body << "\tmov dword [spl_prof_start], __start_splprof\n"
+                  << "\tmov dword [spl_prof_end], __stop_splprof\n";
+        }
+        hasEntry = true;
+    }
+    if (state().stats) state().stats->topInstructions += code.size();
+    writeCode(*body, 0);
+    if (!cold.empty()) {
+        setSection(".text.unlikely", TEXT_ATTRS);
+        *body << cold;
+        cold.clear();
+    }
+}
+
+void codeGenContext::generateCode(const char* fname_c) {
+    string fname = outputName(fname_c, ".asm");
     ofstream out(fname.c_str());
+    generateCode(out);
+    out.close();
+}
+
+void codeGenContext::generateCode(ostream& out) {
+    // A module with nothing but function definitions is a library:
+    // it gets no entry point, so it can be linked with a main module.
+    if (hasEntry || !code.empty()) code.push_back("call exit");
+    flushCode();
+    if (hasEntry) {
+        setSection(".text.start");
+        *body << "_start.end:\n";
+    }
+    if (instrument) {
+        // The module's counters, after a header for the profile: the
+        // line that starts its counts there, and how many there are.
+        setSection("splprof", " progbits alloc noexec write align=4");
+        *body << "SPLPROF: dd SPLPROF_NAME, " << numCounters << '\n'
+              << "SPLPROF_COUNTS: times " << numCounters*2 << " dd 0\n";
+        setSection(".rodata");
+        *body << "SPLPROF_NAME: db `module " << profileKey << ' '
+              << numCounters << ' ';
+        for (char c : sourceName) {
+            if (c == '`' || c == '\\') *body << '\\';
+            *body << c;
+        }
+        *body << "\\n\\0`\n";
+    }
+
     out << "[BITS 32]\n"
         << "extern exit\n"
         << "extern write\n"
@@ -277,54 +881,501 @@ void codeGenContext::generateCode(const char* fname_c) {
         << "extern writebool\n"
         << "extern writelf\n"
         << "extern read\n"
-        << "global _start\n";
-    out << "\nsection .rodata\n";
-    for (unsigned i = 0; i < literals.size(); ++i) {
-        out << getLitID(i) << ": db `" << literals[i] << "\\0`\n";
-    }
-    out << "\nsection .bss\n";
-    for (auto& i : identifiers) {
-        out << getAsmID(i.first) << ": resb 4\n";
-    }
-    out << "\nsection .text\n\n";
-    for (int i = 0; i < children.size(); ++i) {
-        out << "global " << children[i].code[0] << '\n';
-        out << children[i].code[0] << ":\n";
-        for (int j = 1; j < children[i].code.size(); ++j) {
-            if (children[i].labels.front() == j) {
-                children[i].labels.pop_front();
-                out << getLabel(j) << ":\n";
-            }
-            out << '\t' << children[i].code[j] << '\n';
+        << "extern newarray\n"
+        << "extern writearray\n"
+        << "extern boundserror\n";
+    for (symbol f : imports) {
+        if (!hasFunction(f)) out << "extern " << symbolName(f) << '\n';
+    }
+    if (hasEntry && instrument) {
+        out << "extern spl_prof_start\n"
+            << "extern spl_prof_end\n"
+            << "extern __start_splprof\n"
+            << "extern __stop_splprof\n";
+    }
+    if (hasEntry) out << "global _start:function (_start.end - _start)\n";
+    body->seekg(0);
+    out << body->rdbuf();
+    delete body;
+    body = NULL;
+    if (!bodyName.empty()) remove(bodyName.c_str());
+}
+
+// Whether a branch that ran n times, against other times the other
+// way, is cold.
+static bool isCold(unsigned long long n, unsigned long long other) {
+    return n * COLD_RATIO < other;
+}
+
+// With a profile, the branch that ran more often falls through, and one
+// that hardly ever ran is outlined.
+void IfStmt::execCode(codeGenContext& ctx) {
+    unsigned c = ctx.counter(this);
+    unsigned long long taken = ctx.timesRun(c), skipped = ctx.timesRun(c + 1);
+    clause->evalCode(ctx);
+    ctx.code.push_back("test eax, eax");
+    if ((ifblock && isCold(taken, skipped))
+        || (elseblock && isCold(skipped, taken))) {
+        bool coldThen = ifblock && isCold(taken, skipped);
+        const char* jump = coldThen ? "jnz " : "jz ";
+        ctx.code.push_back(jump);
+        unsigned placeHold = ctx.code.size() - 1;
+        Stmt* hot = coldThen ? elseblock : ifblock;
+        if (hot) hot->execCode(ctx);
+        ctx.labels.push_back(ctx.code.size());
+        string back = ctx.getLabel(ctx.code.size());
+        ctx.code[placeHold] = jump + ctx.outline(coldThen ? ifblock : elseblock, back);
+        return;
+    }
+    if (ifblock && elseblock && skipped > taken) {
+        ctx.code.push_back("jnz THEN");
+        unsigned placeHold = ctx.code.size() - 1;
+        elseblock->execCode(ctx);
+        ctx.code.push_back("jmp END");
+        ctx.labels.push_back(ctx.code.size());
+        ctx.code[placeHold] = "jnz " + ctx.getLabel(ctx.code.size());
+        placeHold = ctx.code.size() - 1;
+        ifblock->execCode(ctx);
+        ctx.labels.push_back(ctx.code.size());
+        ctx.code[placeHold] = "jmp " + ctx.getLabel(ctx.code.size());
+        return;
+    }
+    ctx.code.push_back("jz ELSE");
+    unsigned placeHold = ctx.code.size() - 1;
+    ctx.count(c);
+    if (ifblock) ifblock->execCode(ctx);
+    ctx.code.push_back("jmp END");
+    ctx.labels.push_back(ctx.code.size());
+    ctx.code[placeHold] = "jz " + ctx.getLabel(ctx.code.size());
+    placeHold = ctx.code.size()-1;
+    ctx.code.push_back("nop");
+    ctx.count(c + 1);
+    if (elseblock) elseblock->execCode(ctx);
+    ctx.labels.push_back(ctx.code.size());
+    ctx.code[placeHold] = "jmp " + ctx.getLabel(ctx.code.size());
+}
+
+// Whether a loop body is small enough to unroll, and has nothing in it
+// that can't be generated twice.
+static bool canUnroll(Stmt* body) {
+    vector<AST*> nodes;
+    body->listNodes(nodes);
+    if (nodes.size() > UNROLL_NODES) return false;
+    for (AST* node : nodes) {
+        if (dynamic_cast<Fun*>(node) || dynamic_cast<WhileStmt*>(node)) {
+            return false;
         }
-        out << ".RET:\n";
-        out << "\tmov esp, ebp\n";
-        out << "\tpop ebp\n";
-        out << "\tret\n\n";
-    }
-    out << "_start:\n";
-    for (unsigned i = 0; i < code.size(); ++i) {
-        if (labels.front() == i) {
-            labels.pop_front();
-            out << getLabel(i) << ":\n";
+    }
+    return true;
+}
+
+// With a profile, a hot loop is unrolled once: the condition is checked
+// between two copies of the body, and it jumps back half as often.
+void WhileStmt::loopCode(codeGenContext& ctx) {
+    unsigned c = ctx.counter(this);
+    unsigned long long entries = ctx.timesRun(c), trips = ctx.timesRun(c + 1);
+    bool unroll = entries && trips >= UNROLL_TRIPS * entries && canUnroll(body);
+    ctx.count(c);
+    ctx.code.push_back("jmp COND");
+    ctx.labels.push_back(ctx.code.size());
+    unsigned placeHold = ctx.code.size();
+    ctx.count(c + 1);
+    body->execCode(ctx);
+    unsigned exit = 0;
+    if (unroll) {
+        ctx.markLine(getLine());
+        clause->evalCode(ctx);
+        ctx.code.push_back("test eax, eax");
+        ctx.code.push_back("jz END");
+        exit = ctx.code.size() - 1;
+        body->execCode(ctx);
+    }
+    ctx.labels.push_back(ctx.code.size());
+    ctx.code[placeHold-1] = "jmp " + ctx.getLabel(ctx.code.size());
+    ctx.markLine(getLine());
+    clause->evalCode(ctx);
+    ctx.code.push_back("test eax, eax");
+    ctx.code.push_back("jnz " + ctx.getLabel(placeHold));
+    if (unroll) {
+        ctx.labels.push_back(ctx.code.size());
+        ctx.code[exit] = "jz " + ctx.getLabel(ctx.code.size());
+    }
+}
+
+// How far a counted loop's counter may step, and its accesses be from
+// it, for their bounds to be checked before the loop. This keeps the
+// counter from overflowing while it stays below the length of an array.
+static const int MAX_STEP = 1 << 20;
+
+// Splits e into something plus or minus a constant, which is put in
+// offset, and returns the something.
+static Exp* splitOffset(Exp* e, int& offset) {
+    offset = 0;
+    ArithOp* a = dynamic_cast<ArithOp*>(e);
+    if (!a || (a->getOp() != ADD && a->getOp() != SUB)) return e;
+    Num* n = dynamic_cast<Num*>(a->getRight());
+    if (!n || n->getNum() > MAX_STEP) return e;
+    offset = a->getOp() == ADD ? n->getNum() : -n->getNum();
+    return a->getLeft();
+}
+
+// Whether e is the variable var plus or minus a constant, which is put
+// in offset.
+static bool counterPlus(Exp* e, symbol var, int& offset) {
+    Id* id = dynamic_cast<Id*>(splitOffset(e, offset));
+    return id && id->getSym() == var;
+}
+
+// The accesses of a counted loop whose bounds can be checked before it,
+// and the lowest and highest offsets from the counter of each array's.
+struct hoistedBounds {
+    struct range {
+        Id* array;
+        int low, high;
+    };
+    vector<range> arrays;
+    vector<AST*> accesses;
+    int low; // over all of the arrays
+    Id* lengthOf; // the array whose length the limit is, if it is one
+    int limitOffset; // added to that, or to whatever the limit is
+};
+
+/* Finds the accesses in a counted loop, "while i < n" (or <=), whose
+ * body ends by adding a positive constant to i. Until then, i keeps
+ * the value it had when the condition held, which was at least what it
+ * started at. So an access to a[i + k] is in bounds every time if i + k
+ * is when i starts, and n - 1 + k (or n + k) is less than the length of
+ * a, as long as nothing else in the body can change i, n or a. The limit
+ * n may be a number, a variable or the length of one, plus or minus a
+ * constant. Nothing but a function can change a global, so then the
+ * loop must make no calls. Returns false if there are no such accesses.
+ */
+static bool countedLoop(Exp* clause, Stmt* body, codeGenContext& ctx,
+                        hoistedBounds& h) {
+    CompOp* cond = dynamic_cast<CompOp*>(clause);
+    Block* block = dynamic_cast<Block*>(body);
+    if (!cond || !block || !block->getBody()) return false;
+    if (cond->getOp() != LT && cond->getOp() != LE) return false;
+    Id* counter = dynamic_cast<Id*>(cond->getLeft());
+    if (!counter) return false;
+    symbol var = counter->getSym();
+    vector<Id*> fixed(1, counter); // what must not change
+    Exp* limit = splitOffset(cond->getRight(), h.limitOffset);
+    h.lengthOf = NULL;
+    if (Length* len = dynamic_cast<Length*>(limit)) {
+        limit = h.lengthOf = dynamic_cast<Id*>(len->getArray());
+    }
+    if (Id* id = dynamic_cast<Id*>(limit)) fixed.push_back(id);
+    else if (!dynamic_cast<Num*>(limit)) return false;
+
+    Stmt* last = block->getBody();
+    while (last->hasNext()) last = last->getNext();
+    Asn* step = dynamic_cast<Asn*>(last);
+    int by;
+    if (!step || step->getLhs()->getSym() != var
+        || !counterPlus(step->getRhs(), var, by) || by <= 0) {
+        return false;
+    }
+
+    vector<AST*> nodes;
+    body->listNodes(nodes);
+    set<symbol> changed;
+    vector<pair<AST*, Id*> > found;
+    vector<int> offsets;
+    bool calls = false;
+    for (AST* node : nodes) {
+        Id* array = NULL;
+        Exp* index = NULL;
+        if (dynamic_cast<Fun*>(node) || dynamic_cast<WhileStmt*>(node)) {
+            return false;
+        }
+        else if (dynamic_cast<Funcall*>(node)) calls = true;
+        else if (NewStmt* s = dynamic_cast<NewStmt*>(node)) {
+            // It hides whatever had the name outside of the body.
+            changed.insert(s->getLhs()->getSym());
+        }
+        else if (Asn* s = dynamic_cast<Asn*>(node)) {
+            if (s != step) changed.insert(s->getLhs()->getSym());
+        }
+        else if (Index* e = dynamic_cast<Index*>(node)) {
+            array = e->getArray();
+            index = e->getIndex();
+        }
+        else if (IndexAsn* s = dynamic_cast<IndexAsn*>(node)) {
+            array = s->getArray();
+            index = s->getIndex();
+        }
+        int k;
+        if (array && array->getSym() != var && counterPlus(index, var, k)) {
+            found.push_back(make_pair(node, array));
+            offsets.push_back(k);
         }
-        out << '\t' << code[i] << '\n';
     }
-    out.close();
+    for (Id* id : fixed) {
+        if (changed.count(id->getSym()) || !ctx.hasIdentifier(id->getSym())) {
+            return false;
+        }
+        if (calls && ctx.getAsmID(id->getSym()).compare(0, 4, "SPL_") == 0) {
+            return false;
+        }
+    }
+
+    h.low = 0;
+    for (unsigned i = 0; i < found.size(); ++i) {
+        symbol a = found[i].second->getSym();
+        if (changed.count(a) || !ctx.hasIdentifier(a)) continue;
+        if (calls && ctx.getAsmID(a).compare(0, 4, "SPL_") == 0) continue;
+        int k = offsets[i];
+        h.accesses.push_back(found[i].first);
+        if (h.accesses.size() == 1 || k < h.low) h.low = k;
+        unsigned r = 0;
+        while (r < h.arrays.size() && h.arrays[r].array->getSym() != a) ++r;
+        if (r == h.arrays.size()) {
+            hoistedBounds::range fresh = { found[i].second, k, k };
+            h.arrays.push_back(fresh);
+        }
+        h.arrays[r].low = min(h.arrays[r].low, k);
+        h.arrays[r].high = max(h.arrays[r].high, k);
+    }
+    return !h.accesses.empty();
+}
+
+// Whether s sets the variable var to a constant of at least least.
+static bool setsAtLeast(Stmt* s, symbol var, int least) {
+    Id* lhs = NULL;
+    Exp* rhs = NULL;
+    if (NewStmt* n = dynamic_cast<NewStmt*>(s)) {
+        lhs = n->getLhs();
+        rhs = n->getRhs();
+    }
+    else if (Asn* a = dynamic_cast<Asn*>(s)) {
+        lhs = a->getLhs();
+        rhs = a->getRhs();
+    }
+    Num* n = dynamic_cast<Num*>(rhs);
+    return lhs && n && lhs->getSym() == var && n->getNum() >= least;
+}
+
+/* A counted loop's array accesses are checked before it, where they can
+ * be (see countedLoop), and if the checks pass, a copy of the loop that
+ * doesn't check them runs instead of the loop as written. Checks that
+ * must pass are left out: the lowest index when the counter has just
+ * been set to a constant, and the highest when the loop runs no further
+ * than the length of the array. If no checks are left, the loop is only
+ * generated the once, without them.
+ */
+void WhileStmt::execCode(codeGenContext& ctx) {
+    Stmt* before = ctx.lastStmt;
+    hoistedBounds h;
+    if (!countedLoop(clause, body, ctx, h)) {
+        loopCode(ctx);
+        return;
+    }
+    CompOp* cond = static_cast<CompOp*>(clause);
+    symbol var = static_cast<Id*>(cond->getLeft())->getSym();
+    int past = cond->getOp() == LE ? 1 : 0; // how far the counter gets past the limit
+
+    vector<unsigned> fails;
+    ostringstream os;
+    if (!setsAtLeast(before, var, -h.low)) {
+        os << "cmp dword [" << ctx.getAsmID(var) << "], " << -h.low;
+        ctx.code.push_back(os.str());
+        ctx.code.push_back("jl CHECKED");
+        fails.push_back(ctx.code.size() - 1);
+    }
+    bool limitLoaded = false;
+    for (hoistedBounds::range& r : h.arrays) {
+        int room = r.high + past; // the limit may be this less than the length
+        if (h.lengthOf && h.lengthOf->getSym() == r.array->getSym()
+            && h.limitOffset + room <= 0) {
+            continue;
+        }
+        if (!limitLoaded) {
+            cond->getRight()->evalCode(ctx);
+            limitLoaded = true;
+        }
+        ctx.code.push_back("mov ebx, [" + ctx.getAsmID(r.array->getSym()) + "]");
+        ctx.code.push_back("mov ebx, [ebx]");
+        if (room != 0) {
+            os.str("");
+            os << "sub ebx, " << room;
+            ctx.code.push_back(os.str());
+        }
+        ctx.code.push_back("cmp eax, ebx");
+        ctx.code.push_back("jg CHECKED");
+        fails.push_back(ctx.code.size() - 1);
+    }
+
+    for (AST* a : h.accesses) ctx.unchecked.insert(a);
+    loopCode(ctx);
+    for (AST* a : h.accesses) ctx.unchecked.erase(a);
+    if (fails.empty()) return;
+    ctx.code.push_back("jmp END");
+    unsigned toEnd = ctx.code.size() - 1;
+    ctx.labels.push_back(ctx.code.size());
+    for (unsigned f : fails) {
+        ctx.code[f] = ctx.code[f].substr(0, 3) + ctx.getLabel(ctx.code.size());
+    }
+    loopCode(ctx);
+    ctx.labels.push_back(ctx.code.size());
+    ctx.code[toEnd] = "jmp " + ctx.getLabel(ctx.code.size());
+}
+
+void Fun::exec() {
+    splContext& spl = state();
+    if (spl.callDepth) {
+        errout << "ERROR: No nested function declarations!\n";
+        spl.error = true;
+        return;
+    }
+    if (spl.funs.count(getNameSym())) {
+        errout << "ERROR: Attempted to redefine function " << getName() << '\n';
+        spl.error = true;
+        return;
+    }
+    spl.funs[getNameSym()] = this;
+    spl.returnTypes[getNameSym()] = retType;
+    // The definition has to outlive the statement it was made in.
+    spl.arena.keep();
+}
+
+Value Fun::call(const Value& arg) {
+    splContext& spl = state();
+    // Once the function is hot, it is called as machine code instead,
+    // if it can be.
+    Value a = arg;
+    if (a.getType() == NUM_T && Jit::hot(jitInfo, Jit::HOT_CALLS)) {
+        if (const jitCode* jit = getJit()) {
+            return ((int (*)(int))jit->entry)(a.num());
+        }
+    }
+    profileTimer t(spl.profiler, this);
+    spl.enterCall(getVarSlot(), arg);
+    spl.retval = Value();
+    body->exec();
+    Value res = spl.retval;
+    spl.leaveCall();
+    return res;
+}
+
+Bytecode& Fun::getBC() {
+    if (!code) {
+        deque<Bytecode>& funcode = state().funcode;
+        funcode.push_back(Bytecode(true));
+        code = &funcode.back();
+        body->execBC(*code);
+        // Falling off the end returns nothing
+        code->emit(UNSET);
+        code->emit(RETOP);
+    }
+    return *code;
+}
+
+// The argument could have any type, so the function's body is inferred
+// once, when it is defined. It returns a known type if every return
+// has it, and it can't fall off the end, which returns nothing.
+void Fun::inferTypes(typeContext& ctx) {
+    splContext& spl = state();
+    vector<bool> assigned = spl.assignedInFuns;
+    for (bool first = true; ; first = false) {
+        typeContext inner(this, first);
+        inner.defined = ctx.defined;
+        inner.scope.bind(var->getSlot(), var);
+        body->inferTypes(inner);
+        if (!inner.changed) {
+            retType = inner.returned && inner.returns ? inner.retType : NONE_T;
+            break;
+        }
+    }
+    if (spl.assignedInFuns != assigned) ctx.changed = true;
+    // Only a definition that will succeed when it runs is recorded.
+    symbol name = getNameSym();
+    if (!ctx.fun && !ctx.defined.count(name) && !spl.returnTypes.count(name)) {
+        ctx.defined[name] = retType;
+    }
+}
+
+VType Funcall::inferType(typeContext& ctx) {
+    arg->infer(ctx);
+    if (calls(ctx.fun)) return NONE_T; // not known until its body is done
+    symbol name = fun->getSym();
+    if (VType* t = ctx.defined.find(name)) return *t;
+    if (VType* t = state().returnTypes.find(name)) return *t;
+    return NONE_T;
+}
+
+Value Funcall::eval() {
+    Value a = arg->eval();
+    Fun** f = state().funs.find(fun->getSym());
+    if (!f) {
+        errout << "Use of undeclared function " << fun->getVal() << '\n';
+        state().error = true;
+        return Value();
+    }
+    return (*f)->call(a);
+}
+
+// A compiled function can only call compiled functions, itself included.
+VType Funcall::evalJit(jitContext& ctx) {
+    Fun** f = state().funs.find(fun->getSym());
+    if (!f || arg->evalJit(ctx) != NUM_T) return NONE_T;
+    if (*f == ctx.fun) ctx.callSelf();
+    else if (const jitCode* jit = (*f)->getJit()) ctx.callFun(*jit);
+    else return NONE_T;
+    return NUM_T;
+}
+
+// Returning sets a flag that makes the enclosing loops and blocks stop,
+// until the call itself is finished.
+// A function that calls itself gives back what one of its other
+// returns does, so such a return adds nothing to its type.
+void Return::inferTypes(typeContext& ctx) {
+    VType type = arg->infer(ctx);
+    ctx.returned = true;
+    Funcall* call = dynamic_cast<Funcall*>(arg);
+    if (!ctx.fun || (call && call->calls(ctx.fun))) return;
+    if (!ctx.returns) ctx.retType = type;
+    else if (ctx.retType != type) ctx.retType = NONE_T;
+    ctx.returns = true;
+}
+
+void Return::exec() {
+    splContext& spl = state();
+    if (!spl.callDepth) {
+        errout << "Cannot return from global scope\n";
+        spl.error = true;
+        return;
+    }
+    spl.retval = arg->eval();
+    spl.returning = true;
 }
 
 void Fun::execCode(codeGenContext& ctx) {
     if (ctx.parent) {
-        std::cerr << "ERROR: No nested function declarations!\n";
-        exit(1);
+        errout << "ERROR: No nested function declarations!\n";
+        state().error = true;
+        return;
     }
-    if (ctx.hasFunction(getName())) {
-        cerr << "ERROR: Attempted to redefine function " << getName() << '\n';
-        exit(1);
+    if (ctx.hasFunction(getNameSym())) {
+        errout << "ERROR: Attempted to redefine function " << getName() << '\n';
+        state().error = true;
+        return;
     }
+    ctx.functions[getNameSym()] = true;
+    state().returnTypes[getNameSym()] = retType;
     ctx.children.push_back(codeGenContext(&ctx));
     codeGenContext& childctx = ctx.children.back();
     childctx.code.push_back(getName());
+    childctx.markLine(getLine());
+    unsigned c = ctx.counter(this);
+    childctx.count(c);
+    // Functions that run often are kept together, and those that
+    // never ran are kept out of their way.
+    if (ctx.profile) {
+        unsigned long long calls = ctx.timesRun(c);
+        if (calls == 0) childctx.textSection = ".text.unlikely";
+        else if (calls >= HOT_FUNCTION_CALLS) childctx.textSection = ".text.hot";
+    }
     childctx.code.push_back("push ebp");
     childctx.code.push_back("mov ebp, esp");
     childctx.addIdentifier(getVar());
@@ -333,6 +1384,13 @@ void Fun::execCode(codeGenContext& ctx) {
     unsigned placeholder = childctx.code.size()-1;
     body->execCode(childctx);
     ostringstream os;
-    os << "sub esp, " << (childctx.identifiers.size()-1)*4;
+    // Every binding in the function has its own slot, even those of
+    // blocks that have ended, apart from the argument pushed above.
+    os << "sub esp, " << (childctx.numids-1)*4;
     childctx.code[placeholder] = os.str();
+    // Nothing else refers to the function's code, so it can go out now.
+    if (ctx.body) {
+        phaseTimer t(state().stats, WRITING);
+        ctx.flushFunctions();
+    }
 }
@@ -9,27 +9,32 @@
 #define AST_HPP
 
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <set>
 #include <deque>
+#include <unordered_map>
 using namespace std;
 
 #include "colorout.hpp"
 #include "value.hpp"
+#include "intern.hpp"
+#include "arena.hpp"
+#include "context.hpp"
+#include "vm.hpp"
+#include "jit.hpp"
 #include "st.hpp"
+#include "stats.hpp"
+#include "profile.hpp"
+#include "pgo.hpp"
 
-// Declare the output streams to use everywhere
-extern colorout resout;
-extern colorout errout;
-
-// Global variable to indicate if an error has occurred.
-extern bool error;
-
-// Global variable to indicate there is a human typing at a keyboard
-extern bool showPrompt;
+// Declare the output streams to use everywhere.
+// Each thread has its own, so concurrent compilations don't interleave.
+extern thread_local colorout resout;
+extern thread_local colorout errout;
 
 // This enum type gives codes to the different kinds of operators.
 // Basically, each oper below such as DIV becomes an integer constant.
@@ -45,12 +50,12 @@ enum Oper {
 // They show the class hierarchy.
 class AST;
   class Stmt;
-    class NullStmt;
     class Block;
     class IfStmt;
     class WhileStmt;
     class NewStmt;
     class Asn;
+    class IndexAsn;
     class Write;
     class WriteStr;
     class Fun;
@@ -66,22 +71,75 @@ class AST;
     class NegOp;
     class NotOp;
     class Read;
+    class NewArray;
+    class Index;
+    class Length;
     class Funcall;
   class StrExp;
 
 struct codeGenContext {
     codeGenContext* parent;
-    vector<codeGenContext> children;
-    vector<string> literals;
-    map<string, int> identifiers;
+    vector<codeGenContext> children; // functions not yet written out
+    symbolMap<bool> functions; // every function defined so far
+    vector<string> literals; // literals not yet written out
+    unsigned numlits;
+    SymbolTable<int> identifiers; // variables in scope, by symbol
+    symbolMap<int> globalNames; // how many globals each name has had
+    vector<string> newids; // globals not yet written out
+    vector<symbol> imports; // functions called here but defined in another module
+    symbolMap<bool> imported;
     vector<string> code;
     deque<unsigned> labels;
+    unsigned codeBase; // lines of top-level code already written out
     int numids;
-    void addIdentifier(const string& s) {
-        identifiers[s] = numids++;
+    bool allowImports; // undeclared functions become externs instead of errors
+    bool hasEntry; // some top-level code has been written out
+    iostream* body; // code is streamed here, and the header added at the end
+    string bodyName; // the file body is kept in, if any
+    string section; // the section body is currently writing to
+    set<string> sectionsUsed; // those declared, with their attributes
+    const char* textSection; // the section a function's code goes in
+    string labelTag; // tells apart the labels of code outlined from here
+    string cold; // code moved out of line, to go after the rest
+    // In the global scope: whether an array has been made yet, and
+    // whether a value of no known type has been written as a number.
+    // Compiled code can't tell an array from a number when it runs.
+    bool madeArrays, untypedWrites;
+
+    // Profile-guided optimization. An instrumented module keeps counters
+    // for its branches, loops, calls and functions; a profile has the
+    // counts from running one.
+    bool instrument;
+    const vector<unsigned long long>* profile;
+    unordered_map<AST*, unsigned> firstCounter; // in this statement
+    unsigned numCounters;
+    unsigned numOutlined;
+    string profileKey; // identifies the module's source in the profile
+    string sourceName;
+
+    // With -g, the source line of the code from each index on, for nasm
+    // to put in the debug info, and the line last written out.
+    bool debugInfo;
+    deque<pair<unsigned, unsigned> > lines;
+    unsigned lineWritten;
+
+    // Array accesses whose bounds have been checked before the loop
+    // they are in, while its unchecked copy is generated.
+    set<AST*> unchecked;
+    // The statement generated just before the current one in its block.
+    Stmt* lastStmt;
+
+    // Binds a new variable in the innermost scope. In a function it
+    // gets the next stack slot; at the top level, a new global.
+    void addIdentifier(symbol s) {
+        if (!parent) {
+            identifiers.bind(s, globalNames[s]++);
+            newids.push_back(getAsmID(s));
+        }
+        else identifiers.bind(s, numids++);
     }
-    bool hasIdentifier(const string& s) {
-        if (identifiers.find(s) != identifiers.end()) return true;
+    bool hasIdentifier(symbol s) {
+        if (identifiers.lookup(s)) return true;
         if (parent && parent->hasIdentifier(s)) return true;
         return false;
     }
@@ -90,15 +148,26 @@ struct codeGenContext {
         os << "SPLLIT_" << index;
         return os.str();
     }
-    string getAsmID(const string& id) {
+    // Adds a string literal to the module and returns its label.
+    string addLiteral(const string& s) {
+        codeGenContext* global_scope = parent ? parent : this;
+        global_scope->literals.push_back(s);
+        return getLitID(global_scope->numlits++);
+    }
+    string getAsmID(symbol id) {
+        int* slot = identifiers.lookup(id);
         if (!parent) {
-            return "SPL_" + id; //global scope
+            //global scope: a name bound again in another block gets
+            //a numbered global of its own
+            ostringstream os;
+            os << "SPL_" << symbolName(id);
+            if (slot && *slot > 0) os << '.' << *slot;
+            return os.str();
         }
         else {
-            auto it = identifiers.find(id);
-            if (it != identifiers.end()) {
+            if (slot) {
                 ostringstream os;
-                os << "ebp - " << (it->second+1)*4;
+                os << "ebp - " << (*slot+1)*4;
                 return os.str();
             }
             return parent->getAsmID(id);
@@ -106,92 +175,278 @@ struct codeGenContext {
     }
     string getLabel(unsigned index) { //label immediately before statement <index>
         ostringstream os;
-        os << ".L" << index;
+        // Top-level code is written out in pieces between functions, so
+        // its labels can't be local to the last symbol like those in functions.
+        if (!parent) os << "_start";
+        os << ".L" << labelTag << codeBase + index;
         return os.str();
     }
-    bool hasFunction(const string& id) {
+    bool hasFunction(symbol id) {
         codeGenContext* global_scope = parent ? parent : this;
-        for (int i = 0; i < global_scope->children.size(); ++i) {
-            if (global_scope->children[i].code[0] == id) {
-                return true;
-            }
-        }
-        return false;
+        return global_scope->functions.count(id);
+    }
+
+    // Attributes the code that follows to a source line, with -g.
+    void markLine(unsigned line) {
+        codeGenContext* global_scope = parent ? parent : this;
+        if (!global_scope->debugInfo || line == 0) return;
+        if (!lines.empty() && lines.back().second == line) return;
+        lines.push_back(make_pair((unsigned)code.size(), line));
     }
 
+    // Numbers the counters of every node in a top-level statement, in
+    // the same order whether instrumenting or using the profile.
+    void numberCounters(AST* tree);
+    // The first of a node's counters.
+    unsigned counter(AST* node) {
+        codeGenContext* global_scope = parent ? parent : this;
+        if (!global_scope->instrument && !global_scope->profile) return 0;
+        return global_scope->firstCounter[node];
+    }
+    // Adds one to a counter, if instrumenting.
+    void count(unsigned c);
+    // How many times a counter was counted in the profile; 0 if none.
+    unsigned long long timesRun(unsigned c) {
+        codeGenContext* global_scope = parent ? parent : this;
+        const vector<unsigned long long>* p = global_scope->profile;
+        return p && c < p->size() ? (*p)[c] : 0;
+    }
+    // Generates a statement as cold code, out of the way of the rest,
+    // ending with a jump to back. Returns the label it starts at.
+    string outline(Stmt* s, const string& back);
+
+    // Starts streaming the code for the named source file,
+    // or into memory if there is no file.
+    void startCode(const char* fname = NULL);
+    // Writes out the finished functions, literals and globals.
+    void flushFunctions();
+    // Also writes out the top-level code so far; call between statements.
+    void flushCode();
+    // Finishes the .asm file once the whole source has been compiled.
     void generateCode(const char*);
-    codeGenContext(codeGenContext* p=NULL) : parent(p), numids(0) {}
+    void generateCode(ostream& out);
+    codeGenContext(codeGenContext* p=NULL)
+        : parent(p), numlits(0), codeBase(0), numids(0),
+          allowImports(p ? p->allowImports : false), hasEntry(false),
+          body(NULL), textSection(".text"), madeArrays(false),
+          untypedWrites(false), instrument(false), profile(NULL),
+          numCounters(0), numOutlined(0), debugInfo(false), lineWritten(0),
+          lastStmt(NULL) {}
+
+  private:
+    void setSection(const string& name, const char* attrs = "");
+    void writeCode(ostream& out, unsigned first);
 };
 
+// Replaces a trailing ".spl" on the source file name with ext
+// (e.g. ".asm"), or appends ext if there is no such suffix.
+string outputName(const string& src, const char* ext);
+
 /* The AST class is the super-class for abstract syntax trees.
  * Every type of AST (or AST node) has its own subclass.
  */
 class AST {
   private:
+    // Where the node starts in the source, or 0 if it wasn't parsed.
+    // Columns count from 1, with a tab as one column.
+    unsigned line;
+    unsigned column;
+
     /* Adds this node and all children to the output stream in DOT format. 
-     * nextnode is the index of the next node to add. */
-    void addToDot(ostream& out, int& nextnode);
+     * nextnode is the index of the next node to add. With a profile,
+     * each node is colored by how much of the time was spent in it. */
+    void addToDot(ostream& out, int& nextnode, const Profiler* heat);
 
   protected:
-    // These two protected fields determine the structure of the AST.
-    string nodeLabel;
-    vector<AST*> children;
+    // The structure of the AST is only needed for debugging output, so
+    // nodes keep nothing but their own fields, and these two methods
+    // describe them on demand.
 
-    // Inserts a new AST node as a child of this one.
-    // (where the new node is inserted depends on which subclass.)
-    virtual void ASTchild(AST* child) = 0;
+    // Writes the label this node has in the DOT output.
+    virtual void writeLabel(ostream& out) = 0;
+
+    // Adds this node's children to kids, in order. NULLs are skipped.
+    virtual void getChildren(vector<AST*>&) { }
 
   public:
+    AST() :line(0), column(0) { }
+
+    unsigned getLine() const { return line; }
+    unsigned getColumn() const { return column; }
+    void setPosition(unsigned l, unsigned c) { line = l; column = c; }
+
     /* Writes this AST to a .dot file as named. */
     void writeDot(const char* fname);
 
-    /* Makes a new "empty" AST node. */
-    AST() { nodeLabel = "EMPTY"; }
+    /* Writes several ASTs to one .dot file, colored by the profile of
+     * running them if there is one. */
+    static void writeDot(const char* fname, const vector<AST*>& trees,
+                         const Profiler* heat);
+
+    /* Writes the label this node has in the DOT output (which is
+     * protected, for the nodes' own use, as writeLabel()). */
+    void describe(ostream& out) { writeLabel(out); }
+
+    /* Counts this node and all below it, by class, for --stats. */
+    void countNodes(map<type_index, unsigned long>& counts);
+
+    /* The class this node is counted as: its own, except that the
+     * interpreter's specialized nodes count as the general ones. */
+    virtual type_index nodeClass() { return typeid(*this); }
+
+    /* Lists this node and all below it, each before its children. */
+    void listNodes(vector<AST*>& nodes);
+
+    /* How many profile counters compiled code keeps for this node. */
+    virtual unsigned numCounters() { return 0; }
+
+    /* Nodes are allocated in the current compilation's arena, and are
+     * all freed together when it is released; never one at a time. */
+    static void* operator new(size_t size) { return state().arena.allocate(size); }
+    static void operator delete(void*) { }
 };
 
+// Gives a node the position it starts at, as it is made.
+template <class T>
+inline T* at(T* node, unsigned line, unsigned column = 0) {
+  node->setPosition(line, column);
+  return node;
+}
+
+/* The state of type inference through one top-level statement, or
+ * the body of a function. See inferTypes() below.
+ */
+class typeContext {
+  public:
+    Fun* fun;                 // whose body this is, or NULL
+    SymbolTable<Id*> scope;   // where each variable in scope is declared
+    symbolMap<VType> defined; // functions defined earlier in the statement
+    vector<Id*> globals;      // declared by the statement, in no block
+    bool firstPass;
+    bool changed;             // set if a variable's type had to change
+
+    // For a function body: whether the last statement seen was a
+    // return, and the type of every value it returns, if there is one.
+    bool returned;
+    bool returns;
+    VType retType;
+
+    typeContext(Fun* f, bool first)
+      :fun(f), firstPass(first), changed(false),
+       returned(false), returns(false), retType(NONE_T) { }
+
+    // Makes a variable's type t as well as what it was.
+    void assign(Id* decl, VType t);
+};
+
+/* Finds the types of the expressions and variables in a statement,
+ * wherever they can be known before it runs. A variable has a type if
+ * every value it is ever given (in the statement) has that type, and
+ * nothing outside of the statement can change it.
+ */
+void inferTypes(Stmt* tree);
+
 /* Every AST node that is not a Stmt is an Exp.
  * These represent actual computations that return something
  * (in particular, a Value object).
  */
 class Exp :public AST {
   protected:
-    // Inserts a new AST as a child of this one.
-    void ASTchild(AST* child) { children.push_back(child); }
+    VType type; // the static type, or NONE_T if it isn't known
 
   public:
+    Exp() :type(NONE_T) { }
+
+    VType getType() { return type; }
+    void setType(VType t) { type = t; }
+
+    // Finds the static type of this expression, and its parts.
+    VType infer(typeContext& ctx) { return type = inferType(ctx); }
+
     /* This is the method that must be overridden by all subclasses.
      * It should perform the computation specified by this node, and
      * return the resulting value that gets computed. */
     virtual Value eval() {
-      if (!error) {
-        errout << "eval() not yet implemented for " 
-               << nodeLabel << " nodes!" << endl;
-        error = true;
+      if (!state().error) {
+        errout << "eval() not yet implemented for ";
+        writeLabel(errout);
+        errout << " nodes!" << endl;
+        state().error = true;
       }
       return Value();
     }
     virtual void evalCode(codeGenContext&) {
-        errout << "Error: Not Implemented for " << nodeLabel << endl;
-        exit(1);
+        errout << "Error: Not Implemented for ";
+        writeLabel(errout);
+        errout << endl;
+        state().error = true;
+    }
+
+    /* Compiles this expression to bytecode that pushes its value.
+     * Expressions without instructions of their own are left to eval(). */
+    virtual void evalBC(Bytecode& bc) {
+        bc.emit(EVALNODE, bc.addNode(this));
+    }
+
+    /* Compiles this expression to machine code that leaves its value in
+     * eax, and returns its type; NONE_T if it can't be compiled. */
+    virtual VType evalJit(jitContext&) { return NONE_T; }
+
+    // Returns the type every value of this expression will have.
+    virtual VType inferType(typeContext&) { return NONE_T; }
+
+    // Evaluate, without making a Value. These are right for any
+    // expression, but faster where the type is known. evalBool() gives
+    // the truth of the value, as a condition would see it.
+    virtual int evalNum() { return eval().num(); }
+    virtual bool evalBool() { return eval().coerceBool(); }
+
+    // Evaluates a condition, as eval().coerceBool() would.
+    bool evalCond() {
+      switch (type) {
+        case NUM_T:  return evalNum() != 0;
+        case BOOL_T: return evalBool();
+        default:     return eval().coerceBool();
+      }
     }
 };
 
 class StrExp :public AST {
     private:
-        string s;
+        char* s;
     public:
-        StrExp(string a) : s(escape(a.substr(1, a.size()-2))) { nodeLabel = "StrExp:" + a; }
-        string& getVal() { return s; }
-        void ASTchild(AST* child) { children.push_back(child); }
-        static string escape(const string& a) {
-            string ret = "";
+        // Constructed straight from the quoted token text, which is
+        // unescaped into the one copy this node keeps, in the arena.
+        StrExp(const char* text, size_t len) {
+            s = (char*)state().arena.allocate(len - 1, 1);
+            s[escape(text + 1, len - 2, s)] = '\0';
+        }
+        const char* getVal() { return s; }
+        // Puts the escapes back, to show the literal as it was written.
+        void writeLabel(ostream& out) {
+            out << "StrExp:'";
+            for (const char* p = s; *p; ++p) {
+                switch (*p) {
+                    case '\n': out << "\\n"; break;
+                    case '\t': out << "\\t"; break;
+                    case '\\': case '\'': out << '\\' << *p; break;
+                    default: out << *p; break;
+                }
+            }
+            out << '\'';
+        }
+        // Unescapes len characters of a into ret, and returns how many
+        // characters that produced (never more than len).
+        static size_t escape(const char* a, size_t len, char* ret) {
+            size_t n = 0;
             bool esc = false;
-            for (char c : a) {
+            for (size_t i = 0; i < len; ++i) {
+                char c = a[i];
                 if (esc) {
                     switch (c) {
-                        case 'n': ret = ret + '\n'; break;
-                        case 't': ret = ret + '\t'; break;
-                        default: ret = ret + c; break;
+                        case 'n': ret[n++] = '\n'; break;
+                        case 't': ret[n++] = '\t'; break;
+                        default: ret[n++] = c; break;
                     }
                     esc = false;
                 }
@@ -200,45 +455,68 @@ class StrExp :public AST {
                         esc = true;
                     }
                     else {
-                        ret = ret + c;
+                        ret[n++] = c;
                     }
                 }
             }
             if (esc) {
-                ret = ret + '\\';
+                ret[n++] = '\\';
             }
-            return ret;
+            return n;
         }
         void evalCode(codeGenContext& ctx) {
-            codeGenContext* global_scope = ctx.parent ? ctx.parent : &ctx;
-            global_scope->literals.push_back(s);
-            string id = global_scope->getLitID(global_scope->literals.size()-1);
-            ctx.code.push_back("lea eax, [" + id + "]");
+            ctx.code.push_back("lea eax, [" + ctx.addLiteral(s) + "]");
         }
 };
 
 /* An identifier, i.e. variable or function name. */
 class Id :public Exp {
   private:
-    string val;
+    symbol val;
+    int slot; // where the interpreter keeps the variable
 
   public:
     // Constructor from a C-style string
     Id(const char* v) { 
-      val = v;
-      nodeLabel = "Exp:Id:" + val;
+      val = intern(v, strlen(v));
+      slot = state().slot(val);
     }
 
-    // Returns a reference to the stored string value.
-    string& getVal() { return val; }
+    // Constructor from the scanner's token text
+    Id(const char* v, size_t len) :val(intern(v, len)) {
+      slot = state().slot(val);
+    }
+
+    // Returns the interned symbol, and the name it stands for.
+    symbol getSym() { return val; }
+    int getSlot() { return slot; }
+    const string& getVal() { return symbolName(val); }
+    void writeLabel(ostream& out) { out << "Exp:Id:" << getVal(); }
     Value eval();
+    int evalNum() {
+      Value* v = state().lookup(slot);
+      return v ? v->num() : eval().num();
+    }
+    bool evalBool() {
+      Value* v = state().lookup(slot);
+      return v ? v->coerceBool() : eval().coerceBool();
+    }
+    VType inferType(typeContext& ctx);
+    VType evalJit(jitContext& ctx) {
+      jitVar var;
+      if (!ctx.lookup(slot, var)) return NONE_T;
+      ctx.load(var);
+      return var.type;
+    }
     void evalCode(codeGenContext& ctx) {
       if (!ctx.hasIdentifier(val)) {
-        errout << "Undefined identifier " << val << endl;
-        exit(1);
+        errout << "Undefined identifier " << getVal() << endl;
+        state().error = true;
+        return;
       }
       ctx.code.push_back("mov eax, [" + ctx.getAsmID(val) + "]");
     }
+    void evalBC(Bytecode& bc) { bc.emit(LOAD, slot); }
 };
 
 /* A literal number in the program. */
@@ -249,19 +527,25 @@ class Num :public Exp {
   public:
     Num(int v) { 
       val = v;
-      // Converting integers to strings is a little annoying...
-      ostringstream label;
-      label << "Exp:Num:" << val;
-      nodeLabel = label.str();
     }
+    void writeLabel(ostream& out) { out << "Exp:Num:" << val; }
+
+    int getNum() { return val; }
 
     // To evaluate, just return the number!
     Value eval() { return val; }
+    int evalNum() { return val; }
+    VType inferType(typeContext&) { return NUM_T; }
     void evalCode(codeGenContext& ctx) {
       ostringstream os;
       os << "mov eax, " << val;
       ctx.code.push_back(os.str());
     }
+    void evalBC(Bytecode& bc) { bc.emit(PUSH, val); }
+    VType evalJit(jitContext& ctx) {
+      ctx.number(val);
+      return NUM_T;
+    }
 };
 
 /* A literal boolean value like "true" or "false" */
@@ -272,57 +556,151 @@ class BoolExp :public Exp {
   public:
     BoolExp(bool v) { 
       val = v;
-      nodeLabel = "Exp:Bool:";
-      if (v) nodeLabel += "true";
-      else nodeLabel += "false";
+    }
+    void writeLabel(ostream& out) {
+      out << (val ? "Exp:Bool:true" : "Exp:Bool:false");
     }
     Value eval() { return val; }
+    bool evalBool() { return val; }
+    VType inferType(typeContext&) { return BOOL_T; }
     void evalCode(codeGenContext& ctx) {
       ostringstream os;
       os << "mov eax, " << (val ? 1 : 0);
       ctx.code.push_back(os.str());
     }
+    void evalBC(Bytecode& bc) { bc.emit(PUSHB, val); }
+    VType evalJit(jitContext& ctx) {
+      ctx.number(val);
+      return BOOL_T;
+    }
 };
 
 /* A binary opration for arithmetic, like + or *. */
 class ArithOp :public Exp {
-  private:
+  protected:
     Oper op;
     Exp* left;
     Exp* right;
 
   public:
     ArithOp(Exp* l, Oper o, Exp* r);
+    // Makes the node for l o r, specialized to o (see below).
+    static ArithOp* make(Exp* l, Oper o, Exp* r);
+    void writeLabel(ostream& out);
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(left);
+      kids.push_back(right);
+    }
+    Oper getOp() { return op; }
+    Exp* getLeft() { return left; }
+    Exp* getRight() { return right; }
+
+    // Computes l op r.
+    static Value apply(Oper op, int l, int r) {
+      switch(op) {
+        case ADD: return l + r;
+        case SUB: return l - r;
+        case MUL: return l * r;
+        case DIV:
+        case MOD:
+          if (r == 0) {
+            if (!state().error) {
+              state().error = true;
+              errout << "ERROR: Divide by zero" << endl;
+            }
+            return Value();
+          }
+          // INT_MIN / -1 overflows, which traps; it wraps around
+          // instead, as the other operators do.
+          if (r == -1) return op == DIV ? (int)(0u - (unsigned)l) : 0;
+          return op == DIV ? l / r : l % r;
+        default:  return Value(); // shouldn't get here...
+      }
+    }
 
     Value eval();
     void evalCode(codeGenContext& ctx);
+    void evalBC(Bytecode& bc);
+    VType evalJit(jitContext& ctx);
+    VType inferType(typeContext& ctx) {
+      left->infer(ctx);
+      right->infer(ctx);
+      return NUM_T;
+    }
 };
 
 /* A binary operation for comparison, like < or !=. */
 class CompOp :public Exp {
-  private:
+  protected:
     Oper op;
     Exp* left;
     Exp* right;
 
   public:
     CompOp(Exp* l, Oper o, Exp* r);
+    // Makes the node for l o r, specialized to o and its operands.
+    static CompOp* make(Exp* l, Oper o, Exp* r);
+    void writeLabel(ostream& out);
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(left);
+      kids.push_back(right);
+    }
+    Oper getOp() { return op; }
+    Exp* getLeft() { return left; }
+    Exp* getRight() { return right; }
+
+    // Computes l op r.
+    static Value apply(Oper op, int lhs, int rhs) {
+      switch (op) {
+        case LT: return lhs < rhs;
+        case GT: return lhs > rhs;
+        case LE: return lhs <= rhs;
+        case GE: return lhs >= rhs;
+        case EQ: return lhs == rhs;
+        case NE: return lhs != rhs;
+        default: break;
+      }
+      return false;
+    }
 
     Value eval();
     void evalCode(codeGenContext& ctx);
+    void evalBC(Bytecode& bc);
+    VType evalJit(jitContext& ctx);
+    VType inferType(typeContext& ctx) {
+      left->infer(ctx);
+      right->infer(ctx);
+      return BOOL_T;
+    }
 };
 
 /* A binary operation for boolean logic, like "and". */
 class BoolOp :public Exp {
-  private:
+  protected:
     Oper op;
     Exp* left;
     Exp* right;
 
   public:
     BoolOp(Exp* l, Oper o, Exp* r);
+    // Makes the node for l o r, specialized to o.
+    static BoolOp* make(Exp* l, Oper o, Exp* r);
+    void writeLabel(ostream& out) {
+      out << (op == AND ? "Exp:BoolOp:and" : "Exp:BoolOp:or");
+    }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(left);
+      kids.push_back(right);
+    }
     Value eval();
     void evalCode(codeGenContext& ctx);
+    void evalBC(Bytecode& bc);
+    VType evalJit(jitContext& ctx);
+    VType inferType(typeContext& ctx) {
+      left->infer(ctx);
+      right->infer(ctx);
+      return BOOL_T;
+    }
 };
 
 /* This class represents a unary negation operation. */
@@ -332,15 +710,29 @@ class NegOp :public Exp {
 
   public:
     NegOp(Exp* r) { 
-      nodeLabel = "Exp:NegOp";
       right = r;
-      ASTchild(right);
     }
+    void writeLabel(ostream& out) { out << "Exp:NegOp"; }
+    void getChildren(vector<AST*>& kids) { kids.push_back(right); }
     Value eval();
+    int evalNum() { return -right->evalNum(); }
+    VType inferType(typeContext& ctx) {
+      right->infer(ctx);
+      return NUM_T;
+    }
     void evalCode(codeGenContext& ctx) {
         right->evalCode(ctx);
         ctx.code.push_back("neg eax");
     }
+    void evalBC(Bytecode& bc) {
+        right->evalBC(bc);
+        bc.emit(NEGOP);
+    }
+    VType evalJit(jitContext& ctx) {
+        if (right->evalJit(ctx) == NONE_T) return NONE_T;
+        ctx.neg();
+        return NUM_T;
+    }
 };
 
 /* This class represents a unary "not" operation. */
@@ -350,34 +742,183 @@ class NotOp :public Exp {
 
   public:
     NotOp(Exp* r) { 
-      nodeLabel = "Exp:NotOp";
       right = r;
-      ASTchild(right);
     }
-    Value eval() {
-        return !(right->eval().tf());
+    void writeLabel(ostream& out) { out << "Exp:NotOp"; }
+    void getChildren(vector<AST*>& kids) { kids.push_back(right); }
+    Value eval() { return evalBool(); }
+    bool evalBool() { return !right->evalBool(); }
+    VType inferType(typeContext& ctx) {
+      right->infer(ctx);
+      return BOOL_T;
     }
+    // A boolean is already 0 or 1; anything else is made so first.
     void evalCode(codeGenContext& ctx) {
         right->evalCode(ctx);
+        if (right->getType() == BOOL_T) {
+            ctx.code.push_back("xor eax, 1");
+            return;
+        }
         ctx.code.push_back("neg eax");
         ctx.code.push_back("sbb eax, eax");
         ctx.code.push_back("inc eax");
     }
+    void evalBC(Bytecode& bc) {
+        right->evalBC(bc);
+        bc.emit(NOTOP);
+    }
+    VType evalJit(jitContext& ctx) {
+        if (right->evalJit(ctx) != BOOL_T) return NONE_T;
+        ctx.notBool();
+        return BOOL_T;
+    }
 };
 
 /* A read expression. */
 class Read :public Exp {
   public:
-    Read() { nodeLabel = "Exp:Read"; }
+    void writeLabel(ostream& out) { out << "Exp:Read"; }
     Value eval() {
       int x;
-      std::cout << "read> ";
-      std::cin >> x;
+      resout.flush(); // anything written before has to be seen first
+      *state().prompt << "read> ";
+      *state().input >> x;
       return Value(x);
     }
     void evalCode(codeGenContext& ctx) {
         ctx.code.push_back("call read");
     }
+    void evalBC(Bytecode& bc) { bc.emit(READOP); }
+    VType inferType(typeContext&) { return NUM_T; }
+    VType evalJit(jitContext& ctx) {
+      ctx.read();
+      return NUM_T;
+    }
+};
+
+// The most elements an array may have. libspl's newarray keeps to the
+// same limit, so that the size of one always fits in an int.
+const int MAX_ARRAY = (1 << 28) - 1;
+
+/* A new array of the given length, like "[n]", with every element 0.
+ * Arrays hold numbers (a boolean is stored as 0 or 1), and assigning
+ * one or passing it to a function shares it rather than copying it.
+ */
+class NewArray :public Exp {
+  private:
+    Exp* size;
+
+  public:
+    NewArray(Exp* s) {
+      size = s;
+    }
+    void writeLabel(ostream& out) { out << "Exp:NewArray"; }
+    void getChildren(vector<AST*>& kids) { kids.push_back(size); }
+
+    // Makes an array of n zeros, which lasts as long as the context.
+    static Value make(int n);
+
+    Value eval() { return make(size->evalNum()); }
+    VType inferType(typeContext& ctx) {
+      size->infer(ctx);
+      return ARR_T;
+    }
+    void evalCode(codeGenContext& ctx);
+    void evalBC(Bytecode& bc) {
+        size->evalBC(bc);
+        bc.emit(NEWARR);
+    }
+};
+
+/* An element of an array, like "a[i]". */
+class Index :public Exp {
+  private:
+    Id* arr;
+    Exp* index;
+
+  public:
+    Index(Id* a, Exp* i) {
+      arr = a;
+      index = i;
+    }
+    void writeLabel(ostream& out) { out << "Exp:Index"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(arr);
+      kids.push_back(index);
+    }
+    Id* getArray() { return arr; }
+    Exp* getIndex() { return index; }
+
+    // Returns where element i of a is, or NULL (with an error) if a is
+    // not an array, or i is out of its bounds.
+    static int* element(Value& a, int i);
+
+    Value eval() {
+      Value a = arr->eval();
+      int* p = element(a, index->evalNum());
+      return p ? Value(*p) : Value();
+    }
+    int evalNum() {
+      Value a = arr->eval();
+      int* p = element(a, index->evalNum());
+      return p ? *p : 0;
+    }
+    VType inferType(typeContext& ctx) {
+      arr->infer(ctx);
+      index->infer(ctx);
+      return NUM_T;
+    }
+    void evalCode(codeGenContext& ctx);
+    void evalBC(Bytecode& bc) {
+        arr->evalBC(bc);
+        index->evalBC(bc);
+        bc.emit(INDEX);
+    }
+};
+
+/* The length of an array, like "length a". */
+class Length :public Exp {
+  private:
+    Exp* arr;
+
+  public:
+    Length(Exp* a) {
+      arr = a;
+    }
+    void writeLabel(ostream& out) { out << "Exp:Length"; }
+    void getChildren(vector<AST*>& kids) { kids.push_back(arr); }
+    Exp* getArray() { return arr; }
+
+    // Returns the length of a, or nothing (with an error) if it is not
+    // an array.
+    static Value of(Value& a);
+
+    Value eval() {
+      Value a = arr->eval();
+      return of(a);
+    }
+    VType inferType(typeContext& ctx) {
+      arr->infer(ctx);
+      return NUM_T;
+    }
+    // The length is kept just before the elements.
+    void evalCode(codeGenContext& ctx) {
+        arr->evalCode(ctx);
+        ctx.code.push_back("mov eax, [eax]");
+    }
+    void evalBC(Bytecode& bc) {
+        arr->evalBC(bc);
+        bc.emit(LENOP);
+    }
+};
+
+/* A sequence of statements as the parser builds it. The last statement
+ * is kept as well as the first, so that each one is added in constant
+ * time. This is a plain struct so that it can go in the parser's %union.
+ */
+struct StmtList {
+  Stmt* head; // NULL for an empty sequence
+  Stmt* tail;
 };
 
 /* A Stmt is anything that can be evaluated at the top level such
@@ -386,76 +927,67 @@ class Read :public Exp {
  */
 class Stmt :public AST {
   private:
-    // Pointer to the next statement in sequence.
+    // Pointer to the next statement in sequence, or NULL at the end.
     Stmt* next;
 
   protected:
-    // Inserts a new AST as a child of this one.
-    void ASTchild(AST* child) {
-      // This inserts before the last thing in the vector,
-      // i.e., just before the "next" statement
-      children.insert(children.end()-1, child);
-    }
+    // Subclasses add their own children first, then call this.
+    void getChildren(vector<AST*>& kids) { kids.push_back(next); }
 
   public:
     /* This static method is for building sequences of statements by the
-     * parser. It takes two statements, and appends one at the end of the other.
-     * The returned value is a pointer to the new statement representing
-     * the sequence.
+     * parser. It appends s (and any statements after it) to the end of
+     * list, in constant time for a single statement.
      */
-    static Stmt* append(Stmt* a, Stmt* b);
+    static void append(StmtList& list, Stmt* s);
 
-    /* Default constructor. The next statement will be set to NullStmt. */
-    Stmt ();
-
-    // This constructor sets the next statement manually.
-    Stmt (Stmt* nextStmt) {
-      if (nextStmt != NULL) children.push_back(nextStmt);
-      next = nextStmt;
-    }
+    /* Default constructor. The statement starts out last in its sequence. */
+    Stmt () :next(NULL) { }
 
     // Getter and setter for the next statement in sequence.
     Stmt* getNext() { return next; }
-    void setNext(Stmt* nextStmt) { 
-      children.back() = nextStmt; 
-      next = nextStmt;
-    }
+    void setNext(Stmt* nextStmt) { next = nextStmt; }
 
-    // This should only be false in the NullStmt class.
+    // This is false for the last statement in a sequence.
     bool hasNext() { return next != NULL; }
 
     /* This is the command that must be implemented everywhere to
      * execute this Stmt - that is, do whatever it is that this statement
      * says to do. */
     virtual void exec() {
-      if (!error) {
-        errout << "exec() not yet implemented for " 
-               << nodeLabel << " nodes!" << endl;
-        error = true;
+      if (!state().error) {
+        errout << "exec() not yet implemented for ";
+        writeLabel(errout);
+        errout << " nodes!" << endl;
+        state().error = true;
       }
     }
 
     virtual void execCode(codeGenContext&) {
-        errout << "Code Generation not implemented for " << nodeLabel << endl;
-        exit(1);
+        errout << "Code Generation not implemented for ";
+        writeLabel(errout);
+        errout << endl;
+        state().error = true;
     }
-};
 
-/* This class is necessary to terminate a sequence of statements. */
-class NullStmt :public Stmt {
-  public:
-    NullStmt() :Stmt(NULL) { 
-      nodeLabel = "Stmt:Null";
+    /* Compiles just this statement (not the rest of its sequence) to
+     * bytecode. Statements without instructions of their own are left
+     * to exec(). */
+    virtual void execBC(Bytecode& bc) {
+        bc.emit(EXECNODE, bc.addNode(this));
     }
 
-    // Nothing to execute!
-    void exec() { }
-    void execCode(codeGenContext&) {}
+    /* Compiles just this statement to machine code. Returns false if it
+     * can't be compiled. */
+    virtual bool execJit(jitContext&) { return false; }
+
+    // Finds the types in this statement (not the rest of its sequence).
+    virtual void inferTypes(typeContext&) { }
 };
 
 /* This is a statement for a block of code, i.e., code enclosed
- * in curly braces { and }.
- * Eventually, this is where scopes will begin and end.
+ * in curly braces { and }. The body is NULL if the block is empty.
+ * Each block is a scope: variables made in it disappear at its end.
  */
 class Block :public Stmt {
   private:
@@ -463,23 +995,75 @@ class Block :public Stmt {
 
   public:
     Block(Stmt* b) { 
-      nodeLabel = "Stmt:Block";
       body = b;
-      ASTchild(body);
+    }
+    void writeLabel(ostream& out) { out << "Stmt:Block"; }
+    Stmt* getBody() { return body; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(body);
+      Stmt::getChildren(kids);
     }
     void exec() {
-      for (Stmt* p = body; p; p = p->getNext()) {
-        p->exec();
+      splContext& spl = state();
+      SymbolTable<Value>& scope = spl.scope();
+      scope.push();
+      if (!spl.profiler) {
+        for (Stmt* p = body; p && !spl.returning; p = p->getNext()) {
+          p->exec();
+        }
       }
+      else {
+        for (Stmt* p = body; p && !spl.returning; p = p->getNext()) {
+          profileTimer t(spl.profiler, p);
+          p->exec();
+        }
+      }
+      scope.pop();
     }
     void execCode(codeGenContext& ctx) {
+        ctx.identifiers.push();
+        Stmt* last = NULL;
         for (Stmt* p = body; p; p = p->getNext()) {
+            ctx.markLine(p->getLine());
+            ctx.lastStmt = last;
             p->execCode(ctx);
+            last = p;
+        }
+        ctx.lastStmt = NULL;
+        ctx.identifiers.pop();
+    }
+    void execBC(Bytecode& bc) {
+        bc.emit(ENTER);
+        for (Stmt* p = body; p; p = p->getNext()) {
+            p->execBC(bc);
+        }
+        bc.emit(LEAVE);
+    }
+    void inferTypes(typeContext& ctx) {
+        ctx.scope.push();
+        ctx.returned = false;
+        for (Stmt* p = body; p; p = p->getNext()) {
+            ctx.returned = false;
+            p->inferTypes(ctx);
+        }
+        ctx.scope.pop();
+    }
+    bool execJit(jitContext& ctx) {
+        ctx.scope.push();
+        ++ctx.blocks;
+        ctx.returned = false;
+        for (Stmt* p = body; p; p = p->getNext()) {
+            ctx.returned = false;
+            if (!p->execJit(ctx)) return false;
         }
+        --ctx.blocks;
+        ctx.scope.pop();
+        return true;
     }
 };
 
-/* This class is for "if" AND "ifelse" statements. */
+/* This class is for "if" AND "ifelse" statements.
+ * A plain "if" has a NULL else block. */
 class IfStmt :public Stmt {
   private:
     Exp* clause;
@@ -488,36 +1072,63 @@ class IfStmt :public Stmt {
 
   public:
     IfStmt(Exp* e, Stmt* ib, Stmt* eb) { 
-      nodeLabel = "Stmt:If";
       clause = e;
       ifblock = ib;
       elseblock = eb;
-      ASTchild(clause);
-      ASTchild(ifblock);
-      ASTchild(elseblock);
+    }
+    void writeLabel(ostream& out) { out << "Stmt:If"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(clause);
+      kids.push_back(ifblock);
+      kids.push_back(elseblock);
+      Stmt::getChildren(kids);
     }
     void exec() {
-      if (clause->eval().coerceBool()) {
+      if (clause->evalCond()) {
         if (ifblock) ifblock->exec();
       }
       else {
         if (elseblock) elseblock->exec();
       }
     }
-    void execCode(codeGenContext& ctx) {
-        clause->evalCode(ctx);
-        ctx.code.push_back("test eax, eax");
-        ctx.code.push_back("jz ELSE");
-        unsigned placeHold = ctx.code.size() - 1;
-        if (ifblock) ifblock->execCode(ctx);
-        ctx.code.push_back("jmp END");
-        ctx.labels.push_back(ctx.code.size());
-        ctx.code[placeHold] = "jz " + ctx.getLabel(ctx.code.size());
-        placeHold = ctx.code.size()-1;
-        ctx.code.push_back("nop");
-        if (elseblock) elseblock->execCode(ctx);
-        ctx.labels.push_back(ctx.code.size());
-        ctx.code[placeHold] = "jmp " + ctx.getLabel(ctx.code.size());
+    // Counts the runs of each branch: then, and else.
+    unsigned numCounters() { return 2; }
+    void execCode(codeGenContext& ctx);
+    void execBC(Bytecode& bc) {
+        clause->evalBC(bc);
+        bc.emit(JFALSE, 0);
+        int toElse = bc.here() - 1;
+        if (ifblock) ifblock->execBC(bc);
+        bc.emit(JUMP, 0);
+        int toEnd = bc.here() - 1;
+        bc.patch(toElse);
+        if (elseblock) elseblock->execBC(bc);
+        bc.patch(toEnd);
+    }
+    void inferTypes(typeContext& ctx) {
+        clause->infer(ctx);
+        ctx.returned = false;
+        if (ifblock) ifblock->inferTypes(ctx);
+        bool bothReturn = ifblock && ctx.returned;
+        ctx.returned = false;
+        if (elseblock) elseblock->inferTypes(ctx);
+        ctx.returned = bothReturn && elseblock && ctx.returned;
+    }
+    bool execJit(jitContext& ctx) {
+        if (clause->evalJit(ctx) == NONE_T) return false;
+        int toElse = ctx.newLabel();
+        int toEnd = ctx.newLabel();
+        ctx.jumpIf(false, toElse);
+        ctx.returned = false;
+        if (ifblock && !ifblock->execJit(ctx)) return false;
+        bool bothReturn = ifblock && ctx.returned;
+        ctx.jump(toEnd);
+        ctx.place(toElse);
+        ctx.returned = false;
+        if (elseblock && !elseblock->execJit(ctx)) return false;
+        ctx.returned = bothReturn && elseblock && ctx.returned;
+        ctx.place(toEnd);
+        return true;
     }
 };
 
@@ -526,30 +1137,63 @@ class WhileStmt :public Stmt {
   private:
     Exp* clause;
     Stmt* body;
+    jitState jitInfo; // how many times the loop has gone around
+
+    // Generates the loop, with the accesses in ctx.unchecked unchecked.
+    void loopCode(codeGenContext& ctx);
    
   public:
     WhileStmt(Exp* c, Stmt* b) { 
-      nodeLabel = "Stmt:While";
       clause = c;
       body = b;
-      ASTchild(clause);
-      ASTchild(body);
     }
+    void writeLabel(ostream& out) { out << "Stmt:While"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(clause);
+      kids.push_back(body);
+      Stmt::getChildren(kids);
+    }
+    // Once the loop is hot, the rest of it is run as machine code
+    // instead, if it can be.
     void exec() {
-      while (clause->eval().coerceBool()) {
+      bool tryJit = true;
+      while (clause->evalCond()) {
         if (body) body->exec();
+        if (state().returning) break;
+        if (tryJit && Jit::hot(jitInfo, Jit::HOT_LOOPS)) {
+          tryJit = false;
+          if (state().jit.runLoop(this, jitInfo)) break;
+        }
       }
     }
-    void execCode(codeGenContext& ctx) {
-        ctx.code.push_back("jmp COND");
-        ctx.labels.push_back(ctx.code.size());
-        unsigned placeHold = ctx.code.size();
-        body->execCode(ctx);
-        ctx.labels.push_back(ctx.code.size());
-        ctx.code[placeHold-1] = "jmp " + ctx.getLabel(ctx.code.size());
-        clause->evalCode(ctx);
-        ctx.code.push_back("test eax, eax");
-        ctx.code.push_back("jnz " + ctx.getLabel(placeHold));
+    // Counts how often the loop is entered, and goes around.
+    unsigned numCounters() { return 2; }
+    void execCode(codeGenContext& ctx);
+    void execBC(Bytecode& bc) {
+        int top = bc.here();
+        clause->evalBC(bc);
+        bc.emit(JFALSE, 0);
+        int toEnd = bc.here() - 1;
+        if (body) body->execBC(bc);
+        bc.emit(JUMP, top);
+        bc.patch(toEnd);
+    }
+    void inferTypes(typeContext& ctx) {
+        clause->infer(ctx);
+        if (body) body->inferTypes(ctx);
+        ctx.returned = false;
+    }
+    bool execJit(jitContext& ctx) {
+        int top = ctx.newLabel();
+        int toEnd = ctx.newLabel();
+        ctx.place(top);
+        if (clause->evalJit(ctx) == NONE_T) return false;
+        ctx.jumpIf(false, toEnd);
+        if (body && !body->execJit(ctx)) return false;
+        ctx.jump(top);
+        ctx.place(toEnd);
+        ctx.returned = false;
+        return true;
     }
 };
 
@@ -562,32 +1206,96 @@ class NewStmt :public Stmt {
 
   public:
     NewStmt(Id* l, Exp* r) { 
-      nodeLabel = "Stmt:New";
       lhs = l;
       rhs = r;
-      ASTchild(lhs);
-      ASTchild(rhs);
     }
+    void writeLabel(ostream& out) { out << "Stmt:New"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(lhs);
+      kids.push_back(rhs);
+      Stmt::getChildren(kids);
+    }
+    Id* getLhs() { return lhs; }
+    Exp* getRhs() { return rhs; }
     void exec();
     void execCode(codeGenContext& ctx);
+    void execBC(Bytecode& bc);
+    bool execJit(jitContext& ctx);
+    void inferTypes(typeContext& ctx);
 };
 
 /* An assignment statement. This represents a RE-binding in the symbol table. */
 class Asn :public Stmt {
-  private:
+  protected:
     Id* lhs;
     Exp* rhs;
+
+    // Does the assignment, without any specializing.
+    void assign();
    
   public:
     Asn(Id* l, Exp* r) { 
-      nodeLabel = "Stmt:Asn";
       lhs = l;
       rhs = r;
-      ASTchild(lhs);
-      ASTchild(rhs);
     }
-    void exec();
+    // Makes the node for l := r, specialized to its shape.
+    static Asn* make(Id* l, Exp* r);
+    void writeLabel(ostream& out) { out << "Stmt:Asn"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(lhs);
+      kids.push_back(rhs);
+      Stmt::getChildren(kids);
+    }
+    Id* getLhs() { return lhs; }
+    Exp* getRhs() { return rhs; }
+    void exec() { assign(); }
+    void execCode(codeGenContext& ctx);
+    void execBC(Bytecode& bc);
+    bool execJit(jitContext& ctx);
+    void inferTypes(typeContext& ctx);
+};
+
+/* An assignment to an element of an array, like "a[i] := x;". */
+class IndexAsn :public Stmt {
+  private:
+    Id* arr;
+    Exp* index;
+    Exp* rhs;
+
+  public:
+    IndexAsn(Id* a, Exp* i, Exp* r) {
+      arr = a;
+      index = i;
+      rhs = r;
+    }
+    void writeLabel(ostream& out) { out << "Stmt:IndexAsn"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(arr);
+      kids.push_back(index);
+      kids.push_back(rhs);
+      Stmt::getChildren(kids);
+    }
+    Id* getArray() { return arr; }
+    Exp* getIndex() { return index; }
+
+    void exec() {
+      Value a = arr->eval();
+      int i = index->evalNum();
+      int v = rhs->evalNum();
+      if (int* p = Index::element(a, i)) *p = v;
+    }
+    void inferTypes(typeContext& ctx) {
+      arr->infer(ctx);
+      index->infer(ctx);
+      rhs->infer(ctx);
+    }
     void execCode(codeGenContext& ctx);
+    void execBC(Bytecode& bc) {
+      arr->evalBC(bc);
+      index->evalBC(bc);
+      rhs->evalBC(bc);
+      bc.emit(SETELEM);
+    }
 };
 
 /* A write statement. */
@@ -597,24 +1305,27 @@ class Write :public Stmt {
     bool newline;
   public:
     Write(Exp* v, bool nl = true) { 
-      nodeLabel = "Stmt:Write";
       val = v;
-      ASTchild(val);
       newline = nl;
     }
+    void writeLabel(ostream& out) { out << "Stmt:Write"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(val);
+      Stmt::getChildren(kids);
+    }
 
-    void exec() {
-      Value res = val->eval();
-      if (!error) {
-        res.writeTo(resout); 
-        if (newline) resout << '\n';
-      }
-      getNext()->exec();
+    void exec();
+    void inferTypes(typeContext& ctx) { val->infer(ctx); }
+    void execCode(codeGenContext& ctx);
+    void execBC(Bytecode& bc) {
+        val->evalBC(bc);
+        bc.emit(WRITEOP, newline);
     }
-    void execCode(codeGenContext& ctx) {
-        val->evalCode(ctx);
-        ctx.code.push_back("call write");
-        if (newline) ctx.code.push_back("call writelf");
+    bool execJit(jitContext& ctx) {
+        VType type = val->evalJit(ctx);
+        if (type == NONE_T) return false;
+        ctx.writeValue(type, newline);
+        return true;
     }
 };
 
@@ -624,22 +1335,32 @@ class WriteStr :public Stmt {
     bool newline;
   public:
     WriteStr(StrExp* v, bool nl = true) {
-      nodeLabel = "Stmt:Write";
       myval = v;
-      ASTchild(myval);
       newline = nl;
     }
+    void writeLabel(ostream& out) { out << "Stmt:Write"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(myval);
+      Stmt::getChildren(kids);
+    }
     void exec() {
-      string res = myval->getVal();
-      resout << res;
-      if (newline) resout << '\n';
-      getNext()->exec();
+      if (!state().error) {
+        resout << myval->getVal();
+        if (newline) resout << '\n';
+      }
     }
     void execCode(codeGenContext& ctx) {
         myval->evalCode(ctx);
         ctx.code.push_back("call writestr");
         if (newline) ctx.code.push_back("call writelf");
     }
+    void execBC(Bytecode& bc) {
+        bc.emit(WRITESTR, bc.addString(myval->getVal()), newline);
+    }
+    bool execJit(jitContext& ctx) {
+        ctx.writeStr(myval->getVal(), newline);
+        return true;
+    }
 };
 
 /* A lambda expression consists of a parameter name and a body. */
@@ -648,26 +1369,50 @@ class Fun :public Stmt {
     Id* name;
     Id* var;
     Stmt* body;
-
-  protected:
-    void writeLabel(ostream& out) { out << "fun:exp" << flush; }
+    Bytecode* code; // compiled the first time the VM calls it
+    jitState jitInfo; // how many times the tree walker has called it
+    VType retType; // the type of every value it returns, or NONE_T
 
   public:
     Fun(Id* n, Id* v, Stmt* b) { 
-      nodeLabel = "Exp:Fun";
       name = n;
       var = v;
       body = b;
-      ASTchild(var);
-      ASTchild(body);
+      code = NULL;
+      retType = NONE_T;
+    }
+    void writeLabel(ostream& out) { out << "Exp:Fun"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(var);
+      kids.push_back(body);
+      Stmt::getChildren(kids);
     }
 
     // These getter methods are necessary to support actually calling
     // the lambda sometime after it gets created.
-    string& getName() { return name->getVal(); }
-    string& getVar() { return var->getVal(); }
+    const string& getName() { return name->getVal(); }
+    symbol getNameSym() { return name->getSym(); }
+    symbol getVar() { return var->getSym(); }
+    int getVarSlot() { return var->getSlot(); }
     Stmt* getBody() { return body; }
+    VType getReturnType() { return retType; }
+
+    // Defining the function just makes it available to call.
+    void exec();
+    // Runs the body with the argument bound, and returns the result.
+    Value call(const Value& arg);
+    // Returns the body compiled for the VM.
+    Bytecode& getBC();
+    // Gives the function code compiled before, such as from a program
+    // image, in place of its body.
+    void setBC(Bytecode* bc) { code = bc; }
+    // Returns the function compiled to machine code, or NULL if it
+    // can't be. It is compiled the first time this is called.
+    const jitCode* getJit() { return state().jit.compile(this, jitInfo); }
+    // Counts the calls.
+    unsigned numCounters() { return 1; }
     void execCode(codeGenContext& ctx);
+    void inferTypes(typeContext& ctx);
 };
 
 /* A function call consists of the function name, and the actual argument.
@@ -679,21 +1424,43 @@ class Funcall :public Exp {
   
   public:
     Funcall(Id* f, Exp* a) { 
-      nodeLabel = "Exp:Funcall";
       fun = f;
       arg = a;
-      ASTchild(fun);
-      ASTchild(arg);
     }
+    void writeLabel(ostream& out) { out << "Exp:Funcall"; }
+    void getChildren(vector<AST*>& kids) {
+      kids.push_back(fun);
+      kids.push_back(arg);
+    }
+    Value eval();
+    VType inferType(typeContext& ctx);
+    // Whether this calls the function f.
+    bool calls(Fun* f) { return f && fun->getSym() == f->getNameSym(); }
+    // Counts the calls from here.
+    unsigned numCounters() { return 1; }
+    void evalBC(Bytecode& bc) {
+        arg->evalBC(bc);
+        bc.emit(CALLOP, fun->getSym());
+    }
+    VType evalJit(jitContext& ctx);
     void evalCode(codeGenContext& ctx) {
         arg->evalCode(ctx);
-        bool found = false;
-        string name = fun->getVal();
+        symbol name = fun->getSym();
         if (!ctx.hasFunction(name)) {
-            std::cerr << "Use of undeclared function " << name << '\n';
-            exit(1);
+            if (!ctx.allowImports) {
+                errout << "Use of undeclared function " << fun->getVal() << '\n';
+                state().error = true;
+                return;
+            }
+            // Resolved by the linker against another module
+            codeGenContext* global_scope = ctx.parent ? ctx.parent : &ctx;
+            if (!global_scope->imported[name]) {
+                global_scope->imported[name] = true;
+                global_scope->imports.push_back(name);
+            }
         }
-        ctx.code.push_back("call " + name);
+        ctx.count(ctx.counter(this));
+        ctx.code.push_back("call " + fun->getVal());
     }
 };
 
@@ -703,17 +1470,35 @@ class Return : public Stmt {
     public:
         Return(Exp* a) {
             arg = a;
-            nodeLabel = "Stmt:Return";
-            ASTchild(arg);
+        }
+        void writeLabel(ostream& out) { out << "Stmt:Return"; }
+        void getChildren(vector<AST*>& kids) {
+            kids.push_back(arg);
+            Stmt::getChildren(kids);
         }
         void execCode(codeGenContext& ctx) {
             if (!ctx.parent) {
-                cerr << "Cannot return from global scope\n";
-                exit(1);
+                errout << "Cannot return from global scope\n";
+                state().error = true;
+                return;
             }
             arg->evalCode(ctx);
             ctx.code.push_back("jmp .RET");
         }
+        void exec();
+        void inferTypes(typeContext& ctx);
+        void execBC(Bytecode& bc) {
+            if (!bc.inFunction) return Stmt::execBC(bc);
+            arg->evalBC(bc);
+            bc.emit(RETOP);
+        }
+        // Compiled functions only return numbers.
+        bool execJit(jitContext& ctx) {
+            if (!ctx.fun || arg->evalJit(ctx) != NUM_T) return false;
+            ctx.ret();
+            ctx.returned = true;
+            return true;
+        }
 };
 
 class ExpStmt : public Stmt {
@@ -722,12 +1507,105 @@ class ExpStmt : public Stmt {
     public:
         ExpStmt(Exp* a) {
             arg = a;
-            nodeLabel = "Stmt:ExpStmt";
-            ASTchild(arg);
         }
+        void writeLabel(ostream& out) { out << "Stmt:ExpStmt"; }
+        void getChildren(vector<AST*>& kids) {
+            kids.push_back(arg);
+            Stmt::getChildren(kids);
+        }
+        void exec() { arg->eval(); }
+        void inferTypes(typeContext& ctx) { arg->infer(ctx); }
         void execCode(codeGenContext& ctx) {
             arg->evalCode(ctx);
         }
+        void execBC(Bytecode& bc) {
+            arg->evalBC(bc);
+            bc.emit(POP);
+        }
+        bool execJit(jitContext& ctx) {
+            return arg->evalJit(ctx) != NONE_T;
+        }
+};
+
+/* Specialized nodes for the interpreter.
+ * The parser makes one of these in place of a general node wherever it
+ * can, which takes the switch on the operator (and for the fused nodes, a
+ * few virtual calls) out of every run. Fused nodes that assume a variable
+ * holds a number do what the general node would whenever it doesn't.
+ * None of them change code generation or the bytecode.
+ */
+
+template <Oper O>
+class FixedArith :public ArithOp {
+  public:
+    FixedArith(Exp* l, Exp* r) :ArithOp(l, O, r) { }
+    type_index nodeClass() { return typeid(ArithOp); }
+    Value eval() {
+      int l = left->evalNum();
+      int r = right->evalNum();
+      return apply(O, l, r);
+    }
+    int evalNum() { return eval().num(); }
+};
+
+template <Oper O>
+class FixedComp :public CompOp {
+  public:
+    FixedComp(Exp* l, Exp* r) :CompOp(l, O, r) { }
+    type_index nodeClass() { return typeid(CompOp); }
+    Value eval() { return evalBool(); }
+    bool evalBool() {
+      int l = left->evalNum();
+      int r = right->evalNum();
+      return apply(O, l, r).tf();
+    }
+};
+
+// A variable compared with a constant, like "mynum > 100".
+template <Oper O>
+class VarConstComp :public CompOp {
+  public:
+    VarConstComp(Id* l, Num* r) :CompOp(l, O, r) { }
+    type_index nodeClass() { return typeid(CompOp); }
+    Value eval() { return evalBool(); }
+    bool evalBool() {
+      Value* v = state().lookup(static_cast<Id*>(left)->getSlot());
+      if (!v || v->getType() != NUM_T) {
+        int l = left->evalNum();
+        int r = right->evalNum();
+        return apply(O, l, r).tf();
+      }
+      return apply(O, v->num(), static_cast<Num*>(right)->getNum()).tf();
+    }
+};
+
+template <Oper O>
+class FixedBool :public BoolOp {
+  public:
+    FixedBool(Exp* l, Exp* r) :BoolOp(l, O, r) { }
+    type_index nodeClass() { return typeid(BoolOp); }
+    Value eval() { return evalBool(); }
+    bool evalBool() {
+      if (O == AND) return left->evalBool() && right->evalBool();
+      else return left->evalBool() || right->evalBool();
+    }
+};
+
+// An increment or decrement by a constant, like "x := x + 1".
+class IncAsn :public Asn {
+  public:
+    IncAsn(Id* l, ArithOp* r) :Asn(l, r) { }
+    type_index nodeClass() { return typeid(Asn); }
+    void exec() {
+      Value* v = state().lookup(lhs->getSlot());
+      if (!v || v->getType() != NUM_T) {
+        assign();
+        return;
+      }
+      ArithOp* a = static_cast<ArithOp*>(rhs);
+      int k = static_cast<Num*>(a->getRight())->getNum();
+      *v = Value(a->getOp() == ADD ? v->num() + k : v->num() - k);
+    }
 };
 
 #endif //AST_HPP
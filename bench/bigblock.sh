@@ -0,0 +1,48 @@
+#!/bin/sh
+# Stress test for parsing long flat blocks, like generated code has.
+# Compiles one block of N statements for increasing N (up to 1M by
+# default) and fails if the time grows much faster than N does.
+#
+# usage: bench/bigblock.sh [spl] [max statements]
+
+SPL=${1:-./spl}
+MAX=${2:-1000000}
+TMP=${TMPDIR:-/tmp}/bigblock.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# Writes a block of $1 statements to stdout.
+gen() {
+  awk -v n="$1" 'BEGIN {
+    print "{"
+    print "new x := 0;"
+    for (i = 1; i < n; ++i) print "x := x + " i % 100 ";"
+    print "}"
+  }'
+}
+
+# Prints the wall-clock seconds taken to compile $1.
+seconds() {
+  start=$(date +%s.%N)
+  "$SPL" "$1" >/dev/null || exit 1
+  end=$(date +%s.%N)
+  echo "$start $end" | awk '{ printf "%.3f\n", $2 - $1 }'
+}
+
+n=$((MAX / 8))
+prev=
+while [ "$n" -le "$MAX" ]; do
+  gen "$n" > "$TMP/block.spl"
+  t=$(seconds "$TMP/block.spl")
+  echo "$n $t" | awk '{ printf "%8d statements %8.3f s %6.2f us/stmt\n", $1, $2, 1e6 * $2 / $1 }'
+  if [ -n "$prev" ]; then
+    # Doubling N should not much more than double the time.
+    if ! echo "$prev $t" | awk '{ exit !($2 <= 3 * $1 + 0.05) }'; then
+      echo "FAIL: time grew superlinearly" >&2
+      exit 1
+    fi
+  fi
+  prev=$t
+  n=$((n * 2))
+done
+echo "ok: linear"
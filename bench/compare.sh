@@ -0,0 +1,48 @@
+#!/bin/sh
+# Compares benchmark results with a baseline, both as written by
+# bench/run.sh, and fails if any time got worse by more than the
+# threshold: BENCH_THRESHOLD (0.15, so 15% slower) plus BENCH_SLACK
+# seconds (0.01), which keeps noise in very short times from counting.
+# A line of the baseline may give its own threshold in a fourth column.
+#
+# usage: bench/compare.sh [baseline] [results]
+
+BASE=${1:-bench/baseline.tsv}
+NEW=${2:-bench/results.tsv}
+
+if [ ! -f "$BASE" ]; then
+  echo "no baseline in $BASE; save one with 'make bench-baseline'"
+  exit 0
+fi
+
+awk -F '\t' -v threshold="${BENCH_THRESHOLD:-0.15}" \
+    -v slack="${BENCH_SLACK:-0.01}" '
+  /^#/ { next }
+  FNR == NR {
+    base[$1 FS $2] = $3
+    limit[$1 FS $2] = $4 != "" ? $4 : threshold
+    next
+  }
+  {
+    key = $1 FS $2
+    if (!(key in base)) {
+      printf "%-8s %-16s %8s -> %8.3f s\n", $1, $2, "new", $3
+      next
+    }
+    old = base[key]
+    verdict = ""
+    if ($3 > old * (1 + limit[key]) + slack) {
+      verdict = "  REGRESSED"
+      ++bad
+    }
+    else if ($3 < old * (1 - limit[key]) - slack) verdict = "  improved"
+    printf "%-8s %-16s %8.3f -> %8.3f s %+6.1f%%%s\n", $1, $2, old, $3,
+           (old > 0 ? 100 * ($3 - old) / old : 0), verdict
+  }
+  END {
+    if (bad) {
+      printf "FAIL: %d regressed beyond the threshold\n", bad
+      exit 1
+    }
+    print "ok: no regressions"
+  }' "$BASE" "$NEW"
@@ -0,0 +1,51 @@
+/* Measures how much memory the AST takes.
+ * Prints the size of each node class, then builds a typical loop
+ * many times over and reports the arena bytes used per node, which
+ * includes everything a node allocates besides itself.
+ */
+
+#include "../ast.hpp"
+#include <cstdio>
+
+thread_local colorout resout(1, 'u');
+thread_local colorout errout(2, 'r', &resout);
+
+static unsigned long nodes = 0;
+
+// Counts the nodes built by the parser for one copy of:
+//   new i := 0;
+//   while i < 100 { write i * 2 + 1; i := i + 1; }
+static Stmt* loop() {
+  StmtList body = { NULL, NULL };
+  Stmt::append(body,
+    new Write(ArithOp::make(ArithOp::make(new Id("i"), MUL, new Num(2)), ADD, new Num(1))));
+  Stmt::append(body, Asn::make(new Id("i"), ArithOp::make(new Id("i"), ADD, new Num(1))));
+  StmtList prog = { NULL, NULL };
+  Stmt::append(prog, new NewStmt(new Id("i"), new Num(0)));
+  Stmt::append(prog,
+    new WhileStmt(CompOp::make(new Id("i"), LT, new Num(100)), new Block(body.head)));
+  nodes += 19;
+  return prog.head;
+}
+
+#define SIZE(T) printf("  %-10s %3lu\n", #T, (unsigned long)sizeof(T))
+
+int main(int argc, char** argv) {
+  unsigned long copies = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  splContext spl;
+  useContext use(spl);
+
+  printf("bytes per node object:\n");
+  SIZE(Id); SIZE(Num); SIZE(BoolExp); SIZE(StrExp);
+  SIZE(ArithOp); SIZE(CompOp); SIZE(BoolOp); SIZE(NegOp); SIZE(NotOp);
+  SIZE(Read); SIZE(Funcall);
+  SIZE(Block); SIZE(IfStmt); SIZE(WhileStmt); SIZE(NewStmt); SIZE(Asn);
+  SIZE(Write); SIZE(WriteStr); SIZE(Fun); SIZE(Return); SIZE(ExpStmt);
+
+  for (unsigned long i = 0; i < copies; ++i) loop();
+  printf("%lu nodes: %lu arena bytes in %lu allocations\n",
+         nodes, (unsigned long)spl.arena.bytes,
+         (unsigned long)spl.arena.allocations);
+  printf("%.1f bytes per node\n", double(spl.arena.bytes) / nodes);
+  return 0;
+}
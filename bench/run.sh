@@ -0,0 +1,145 @@
+#!/bin/sh
+# End-to-end benchmarks. Times each workload in the interpreter (walking
+# the AST, with and without the JIT, and on the VM), compiling it to
+# assembly, assembling and linking that, and running the binary. The
+# last three need nasm, ld and libspl.o, and are skipped without them.
+# Compiling is also broken down by phase, as --stats=json reports it.
+#
+# Each time is the best of BENCH_RUNS runs (5 by default). They are
+# written to the results file, one per line, as
+#   benchmark <tab> measure <tab> seconds
+# which bench/compare.sh checks against a baseline.
+#
+# usage: bench/run.sh [spl] [results file]
+
+SPL=${1:-./spl}
+OUT=${2:-bench/results.tsv}
+RUNS=${BENCH_RUNS:-5}
+LIBSPL=${LIBSPL:-libspl.o}
+BENCH=$(dirname "$0")
+# A compilation cache would make every run after the first a hit.
+unset SPL_CACHE_DIR
+TMP=${TMPDIR:-/tmp}/bench.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# The hand-written workloads.
+cp "$BENCH/fib.spl" "$TMP/fib.spl"
+cp "$BENCH/loop.spl" "$TMP/loop.spl"
+cp "$BENCH/write.spl" "$TMP/write.spl"
+
+# A very long source: one block of 100000 statements.
+awk 'BEGIN {
+  print "{"
+  print "new x := 0;"
+  for (i = 1; i < 100000; ++i) {
+    if (i % 10) print "x := x + " i % 100 ";"
+    else print "ifelse x > 1000 { x := x - 1000; } { x := x * 2; }"
+  }
+  print "write x;"
+  print "}"
+}' > "$TMP/long.spl"
+
+# Many functions: 2000 of them, each called once.
+awk 'BEGIN {
+  n = 2000
+  print "{"
+  for (i = 1; i <= n; ++i) {
+    print "fun f" i " x {"
+    print "  if x > " i " { return x - " i "; }"
+    print "  return x + " i ";"
+    print "}"
+  }
+  print "new s := 0;"
+  for (i = 1; i <= n; ++i) print "s := f" i " @ s;"
+  print "write s;"
+  print "}"
+}' > "$TMP/funs.spl"
+
+NATIVE=
+if command -v nasm >/dev/null && command -v ld >/dev/null && [ -f "$LIBSPL" ]; then
+  NATIVE=1
+else
+  echo "note: no nasm, ld or $LIBSPL; not timing assembled programs" >&2
+fi
+
+# Prints the best wall-clock seconds taken by a command, of $RUNS runs.
+best() {
+  b=
+  r=0
+  while [ "$r" -lt "$RUNS" ]; do
+    start=$(date +%s.%N)
+    "$@" </dev/null >/dev/null 2>"$TMP/err" || {
+      echo "FAIL: $*" >&2
+      cat "$TMP/err" >&2
+      return 1
+    }
+    end=$(date +%s.%N)
+    b=$(echo "$start $end $b" | awk '{
+      t = $2 - $1
+      if ($3 != "" && $3 < t) t = $3
+      printf "%.4f\n", t
+    }')
+    r=$((r + 1))
+  done
+  echo "$b"
+}
+
+# Times a command and records it as measure $2 of benchmark $1.
+measure() {
+  name=$1
+  what=$2
+  shift 2
+  t=$(best "$@") || exit 1
+  printf '%s\t%s\t%s\n' "$name" "$what" "$t" >> "$TMP/results"
+  printf '%-8s %-16s %8.3f s\n' "$name" "$what" "$t"
+}
+
+# Records the time each phase of compiling $2 takes as measure
+# compile.<phase> of benchmark $1, each the best of $RUNS runs.
+phases() {
+  name=$1
+  src=$2
+  r=0
+  : > "$TMP/phases"
+  while [ "$r" -lt "$RUNS" ]; do
+    "$SPL" --stats=json "$src" </dev/null >/dev/null 2>"$TMP/err" || {
+      echo "FAIL: $SPL --stats=json $src" >&2
+      cat "$TMP/err" >&2
+      exit 1
+    }
+    sed -n 's/.*"seconds": {\([^}]*\)}.*/\1/p' "$TMP/err" |
+      tr ',' '\n' | tr -d ' "' >> "$TMP/phases"
+    r=$((r + 1))
+  done
+  awk -F: -v name="$name" '
+    $1 == "total" || $1 == "assembling" { next }
+    !($1 in b) { order[++n] = $1; b[$1] = $2 }
+    $2 < b[$1] { b[$1] = $2 }
+    END {
+      for (i = 1; i <= n; ++i) {
+        printf "%s\tcompile.%s\t%.6f\n", name, order[i], b[order[i]]
+      }
+    }' "$TMP/phases" > "$TMP/phase-results"
+  cat "$TMP/phase-results" >> "$TMP/results"
+  awk -F '\t' '{ printf "%-8s %-16s %8.4f s\n", $1, $2, $3 }' \
+    "$TMP/phase-results"
+}
+
+echo "# spl benchmarks, best of $RUNS, $(uname -m), $(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+  > "$TMP/results"
+for name in fib loop write long funs; do
+  src=$TMP/$name.spl
+  measure $name walk "$SPL" --run "$src"
+  measure $name nojit "$SPL" --run --no-jit "$src"
+  measure $name vm "$SPL" --run --vm "$src"
+  measure $name compile "$SPL" "$src"
+  phases $name "$src"
+  if [ -n "$NATIVE" ]; then
+    measure $name assemble nasm -felf "$TMP/$name.asm" -o "$TMP/$name.o"
+    measure $name link ld "$TMP/$name.o" "$LIBSPL" -x -m elf_i386 -o "$TMP/$name"
+    measure $name native "$TMP/$name"
+  fi
+done
+mv "$TMP/results" "$OUT" || exit 1
+echo "results in $OUT"
@@ -0,0 +1,84 @@
+#!/bin/sh
+# Stress test for the compile server's cache. Starts a server with an
+# empty cache and sends it many compiles (assembled, with -c) at once,
+# all of the same few sources, so that hits, misses and stores race.
+# Fails if any request fails or hangs, if any .asm differs from what
+# spl writes itself, or if the cache didn't count every lookup.
+#
+# usage: bench/server.sh [spl] [spl-client] [requests]
+
+SPL=${1:-./spl}
+CLIENT=${2:-./spl-client}
+N=${3:-64}
+TMP=${TMPDIR:-/tmp}/server.$$
+mkdir -p "$TMP/cache" "$TMP/ref" || exit 1
+SPL_SERVER=$TMP/sock
+export SPL_SERVER
+unset SPL_CACHE_DIR
+
+"$SPL" --server --cache "$TMP/cache" -j 8 2>"$TMP/server.log" &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -rf "$TMP"' EXIT
+
+# Writes source number $1 to stdout.
+gen() {
+  awk -v k="$1" 'BEGIN {
+    print "{"
+    print "new x := " k ";"
+    for (i = 0; i < 200; ++i) print "x := x * 3 % 1000 + " i ";"
+    print "write x;"
+    print "}"
+  }'
+}
+
+for k in 0 1 2 3; do
+  gen $k > "$TMP/ref/s$k.spl"
+  "$SPL" -c "$TMP/ref/s$k.spl" || exit 1
+done
+
+i=0
+while [ ! -S "$SPL_SERVER" ]; do
+  i=$((i + 1))
+  if [ "$i" -gt 50 ]; then
+    echo "FAIL: the server didn't start" >&2
+    cat "$TMP/server.log" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+pids=
+i=0
+while [ "$i" -lt "$N" ]; do
+  k=$((i % 4))
+  mkdir "$TMP/c$i"
+  cp "$TMP/ref/s$k.spl" "$TMP/c$i/"
+  ( timeout 60 "$CLIENT" -c "$TMP/c$i/s$k.spl" 2>"$TMP/c$i/err"; echo $? > "$TMP/c$i/status" ) &
+  pids="$pids $!"
+  i=$((i + 1))
+done
+wait $pids
+
+i=0
+while [ "$i" -lt "$N" ]; do
+  k=$((i % 4))
+  status=$(cat "$TMP/c$i/status")
+  if [ "$status" != 0 ]; then
+    echo "FAIL: request $i exited with $status" >&2
+    cat "$TMP/c$i/err" >&2
+    exit 1
+  fi
+  if ! cmp -s "$TMP/ref/s$k.asm" "$TMP/c$i/s$k.asm"; then
+    echo "FAIL: request $i compiled differently" >&2
+    exit 1
+  fi
+  i=$((i + 1))
+done
+
+lookups=$("$SPL" --cache "$TMP/cache" --cache-stats 2>&1 </dev/null |
+          awk '/hits:|misses:/ { n += $2 } END { print n + 0 }')
+if [ "$lookups" != "$N" ]; then
+  echo "FAIL: the cache counted $lookups lookups of $N" >&2
+  exit 1
+fi
+echo "ok: $N requests"
@@ -0,0 +1,189 @@
+/* Implementation of the on-disk compilation cache.
+ * Entries are plain files named by key. Every writer creates a private
+ * temporary file and renames it into place, so readers never see a partial
+ * entry; the statistics and eviction are serialized with flock.
+ */
+
+#include "cache.hpp"
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <utime.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+// Held by any thread holding the cache lock. A child forked while some
+// other thread held the lock would share its flock, and keep it even
+// after that thread let it go, so fork waits for this too.
+static mutex lockHolders;
+static void lockForFork() { lockHolders.lock(); }
+static void unlockForFork() { lockHolders.unlock(); }
+static const int forkHandlers =
+  pthread_atfork(lockForFork, unlockForFork, unlockForFork);
+
+// Holds the cache's lock file for as long as it is in scope. It isn't
+// left open in the programs the compiler runs, such as nasm.
+struct cacheLock {
+  lock_guard<mutex> held;
+  int fd;
+  cacheLock(const string& dir) :held(lockHolders) {
+    fd = open((dir + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) flock(fd, LOCK_EX);
+  }
+  ~cacheLock() {
+    if (fd >= 0) {
+      flock(fd, LOCK_UN);
+      close(fd);
+    }
+  }
+};
+
+// Creates dir and any missing parents.
+static void makeDirs(const string& dir) {
+  for (size_t i = 1; i <= dir.size(); ++i) {
+    if (i == dir.size() || dir[i] == '/') {
+      mkdir(dir.substr(0, i).c_str(), 0755);
+    }
+  }
+}
+
+static bool copyFile(const string& src, const string& dest) {
+  ifstream in(src.c_str(), ios::binary);
+  if (!in) return false;
+  ofstream out(dest.c_str(), ios::binary);
+  out << in.rdbuf();
+  return bool(out);
+}
+
+// 64-bit FNV-1a, continued from h.
+static unsigned long long fnv(const char* s, size_t len, unsigned long long h) {
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static unsigned long long fnv(const string& s, unsigned long long h) {
+  return fnv(s.data(), s.size(), h);
+}
+
+string compileCache::key(const char* source, size_t len, const string& options) {
+  // Two independent hashes, with the lengths mixed in so that
+  // different splits of the same bytes cannot collide.
+  ostringstream hdr;
+  hdr << SPL_VERSION << '\0' << options.size() << ':' << options
+      << '\0' << len << ':';
+  unsigned long long h1 = fnv(source, len, fnv(hdr.str(), 14695981039346656037ULL));
+  unsigned long long h2 = fnv(hdr.str(), fnv(source, len, 0x84222325cbf29ce4ULL));
+  char buf[33];
+  snprintf(buf, sizeof buf, "%016llx%016llx", h1, h2);
+  return buf;
+}
+
+bool compileCache::fetch(const string& key, const char* ext, const string& dest) {
+  string path = entry(key, ext);
+  if (!copyFile(path, dest)) return false;
+  utime(path.c_str(), NULL); // mark as recently used
+  return true;
+}
+
+void compileCache::store(const string& key, const char* ext, const string& src) {
+  makeDirs(dir);
+  // Unique across processes and the threads within each one
+  static atomic<unsigned> serial(0);
+  ostringstream tmp;
+  tmp << entry(key, ext) << ".tmp." << getpid() << '.' << serial++;
+  if (!copyFile(src, tmp.str())) {
+    remove(tmp.str().c_str());
+    return;
+  }
+  rename(tmp.str().c_str(), entry(key, ext).c_str());
+  cacheLock lock(dir);
+  evict();
+}
+
+void compileCache::record(bool hit) {
+  makeDirs(dir);
+  cacheLock lock(dir);
+  count(hit ? 1 : 0, hit ? 0 : 1);
+}
+
+void compileCache::count(unsigned long hits, unsigned long misses) {
+  string path = dir + "/stats";
+  unsigned long h = 0, m = 0;
+  ifstream in(path.c_str());
+  in >> h >> m;
+  in.close();
+  ofstream out(path.c_str());
+  out << h + hits << ' ' << m + misses << endl;
+}
+
+struct cacheEntry {
+  string path;
+  time_t used;
+  off_t size;
+  bool operator<(const cacheEntry& other) const { return used < other.used; }
+};
+
+// Lists the finished entries in dir, skipping the lock, statistics
+// and any temporary files still being written.
+static vector<cacheEntry> listEntries(const string& dir) {
+  vector<cacheEntry> entries;
+  DIR* d = opendir(dir.c_str());
+  if (!d) return entries;
+  while (struct dirent* ent = readdir(d)) {
+    string name = ent->d_name;
+    if (name[0] == '.' || name == "lock" || name == "stats") continue;
+    if (name.find(".tmp.") != string::npos) continue;
+    cacheEntry e;
+    e.path = dir + "/" + name;
+    struct stat st;
+    if (stat(e.path.c_str(), &st) != 0) continue;
+    e.used = st.st_mtime;
+    e.size = st.st_size;
+    entries.push_back(e);
+  }
+  closedir(d);
+  return entries;
+}
+
+void compileCache::evict() {
+  vector<cacheEntry> entries = listEntries(dir);
+  unsigned long long total = 0;
+  for (auto& e : entries) total += e.size;
+  if (total <= limit) return;
+  sort(entries.begin(), entries.end());
+  for (auto& e : entries) {
+    if (total <= limit) break;
+    if (remove(e.path.c_str()) == 0) total -= e.size;
+  }
+}
+
+void compileCache::writeStats(ostream& out) {
+  unsigned long h = 0, m = 0;
+  {
+    cacheLock lock(dir);
+    ifstream in((dir + "/stats").c_str());
+    in >> h >> m;
+  }
+  vector<cacheEntry> entries = listEntries(dir);
+  unsigned long long total = 0;
+  for (auto& e : entries) total += e.size;
+  unsigned long lookups = h + m;
+  out << "cache: " << dir << endl
+      << "  hits:    " << h << endl
+      << "  misses:  " << m << endl
+      << "  hit rate: " << (lookups ? 100 * h / lookups : 0) << "%" << endl
+      << "  entries: " << entries.size() << endl
+      << "  size:    " << total << " of " << limit << " bytes" << endl;
+}
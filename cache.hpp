@@ -0,0 +1,56 @@
+/* C++ header file for the compilation cache.
+ * Compiled modules are stored on disk under a hash of their source text,
+ * the compiler version and the options, so that recompiling an unchanged
+ * file just copies the previous result.
+ */
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <iostream>
+#include <string>
+using namespace std;
+
+// Bump this whenever code generation changes, to invalidate old entries.
+#define SPL_VERSION "spl-1.3"
+
+class compileCache {
+  private:
+    string dir;
+    unsigned long long limit; // total bytes of entries to keep
+
+    string entry(const string& key, const char* ext) {
+      return dir + "/" + key + ext;
+    }
+
+    // Runs under the cache lock: adds to the hit/miss counters.
+    void count(unsigned long hits, unsigned long misses);
+
+    // Runs under the cache lock: removes least recently used
+    // entries until the cache fits in its size limit.
+    void evict();
+
+  public:
+    compileCache(const string& d, unsigned long long lim)
+      :dir(d), limit(lim) { }
+
+    // Returns the hex key for this source compiled with these options.
+    static string key(const char* source, size_t len, const string& options);
+    static string key(const string& source, const string& options) {
+      return key(source.data(), source.size(), options);
+    }
+
+    // Copies the cached entry to dest. Returns false on a miss.
+    bool fetch(const string& key, const char* ext, const string& dest);
+
+    // Saves src as the entry for key, evicting old entries if needed.
+    void store(const string& key, const char* ext, const string& src);
+
+    // Records the outcome of one lookup in the shared statistics.
+    void record(bool hit);
+
+    // Writes the hit/miss statistics and current size of the cache.
+    void writeStats(ostream& out);
+};
+
+#endif // CACHE_HPP
@@ -0,0 +1,212 @@
+/* The client for the compile server.
+ * spl-client takes the same arguments as spl. Each file is sent to the
+ * server, which compiles or runs it and sends back what to write; only
+ * linking is done here. Anything the server can't do for it, and any
+ * time there is no server, is handed to spl itself instead.
+ */
+
+#include "server.hpp"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Runs spl with the same arguments, in place of this process.
+static void handOff(char** argv) {
+  string spl = "spl";
+  const char* slash = strrchr(argv[0], '/');
+  if (slash) spl = string(argv[0], slash + 1 - argv[0]) + "spl";
+  execvp(spl.c_str(), argv);
+  cerr << "Could not run " << spl << endl;
+  exit(127);
+}
+
+// Runs spl as handOff does, giving it the standard input this process
+// has already read.
+static void handOff(char** argv, const string& input) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    cerr << "Could not make a pipe" << endl;
+    exit(127);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    writeAll(fds[1], input.data(), input.size());
+    _exit(0);
+  }
+  close(fds[1]);
+  dup2(fds[0], 0);
+  close(fds[0]);
+  handOff(argv);
+}
+
+static int connectTo(const string& path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) return -1;
+  strcpy(addr.sun_path, path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof addr) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// Sends a request on a connection, waits for the reply, and closes it.
+// Returns false if the server gave up on it.
+static bool exchange(int fd, const message& req, message& reply) {
+  bool ok = sendMessage(fd, req) && readMessage(fd, reply)
+         && reply.count("status");
+  close(fd);
+  return ok;
+}
+
+// Sends a request, and waits for the reply. Returns false if the
+// server could not be reached or gave up on it.
+static bool ask(const string& path, const message& req, message& reply) {
+  int fd = connectTo(path);
+  return fd >= 0 && exchange(fd, req, reply);
+}
+
+static bool readFile(const char* fname, string& out) {
+  ifstream in(fname, ios::binary);
+  if (!in) return false;
+  ostringstream s;
+  s << in.rdbuf();
+  out = s.str();
+  return true;
+}
+
+// Links the objects into program, as spl -o does. Returns spl's exit code.
+static int linkProgram(const char* program, const vector<string>& objs,
+                const char* libspl) {
+  vector<const char*> ld = {"ld", "-x", "-m", "elf_i386", "-o", program};
+  for (auto& o : objs) ld.push_back(o.c_str());
+  ld.push_back(libspl);
+  ld.push_back(NULL);
+  pid_t pid = fork();
+  if (pid < 0) return 5;
+  if (pid == 0) {
+    execvp(ld[0], (char* const*)ld.data());
+    cerr << "Could not run ld" << endl;
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0) {
+    return 5;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  bool assemble = false;
+  bool debug = false;
+  bool run = false;
+  bool useVM = false;
+  const char* program = NULL;
+  const char* libspl = "libspl.o";
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  vector<const char*> files;
+  // Only these options can be given to the server request by request;
+  // the rest are spl's alone.
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "-c") assemble = true;
+    else if (arg == "-g") debug = true;
+    else if (arg == "-o" && i+1 < argc) program = argv[++i];
+    else if (arg == "-L" && i+1 < argc) libspl = argv[++i];
+    else if (arg == "-j" && i+1 < argc) jobs = atoi(argv[++i]);
+    else if (arg == "--run") run = true;
+    else if (arg == "--vm") useVM = true;
+    else if (arg[0] == '-' && arg.size() > 1) handOff(argv);
+    else files.push_back(argv[i]);
+  }
+  if (jobs < 1) jobs = 1;
+  string path = serverSocket();
+
+  if (run || (files.empty() && !isatty(0))) {
+    // Whatever the script reads is sent along with it, so a script
+    // that reads from a terminal, or more than one script sharing the
+    // input, has to be run by spl.
+    if (files.size() > 1 || (!files.empty() && isatty(0))) handOff(argv);
+    // The server is reached first, so that standard input is still
+    // there for spl if it isn't.
+    int fd = connectTo(path);
+    if (fd < 0) handOff(argv);
+    message req, reply;
+    req["op"] = "run";
+    if (useVM) req["vm"] = "";
+    if (files.empty()) {
+      req["name"] = "spl";
+      readAll(0, req["source"]);
+    }
+    else {
+      req["name"] = files[0];
+      if (!readFile(files[0], req["source"])) {
+        cerr << "Could not open input file \"" << files[0] << "\"!" << endl;
+        return 2;
+      }
+      readAll(0, req["input"]);
+    }
+    if (!exchange(fd, req, reply)) {
+      handOff(argv, files.empty() ? req["source"] : req["input"]);
+    }
+    cout << reply["output"] << flush;
+    cerr << reply["diagnostics"];
+    return atoi(reply["status"].c_str());
+  }
+  if (files.empty()) handOff(argv); // the interactive interpreter
+
+  // The files are sent up to jobs at a time, as spl would compile them.
+  bool allowImports = files.size() > 1 || assemble || program;
+  vector<message> replies(files.size());
+  atomic<unsigned> next(0);
+  atomic<bool> reached(true);
+  vector<thread> senders;
+  for (int j = 0; j < jobs && j < (int)files.size(); ++j) {
+    senders.push_back(thread([&]() {
+      for (unsigned i = next++; i < files.size(); i = next++) {
+        message req;
+        req["op"] = "compile";
+        req["name"] = files[i];
+        if (!readFile(files[i], req["source"])) {
+          replies[i]["status"] = "2";
+          replies[i]["diagnostics"] = string("Could not open input file \"")
+                                    + files[i] + "\"!\n";
+          continue;
+        }
+        if (allowImports) req["imports"] = "";
+        if (assemble || program) req["assemble"] = "";
+        if (debug) req["debug"] = "";
+        if (!ask(path, req, replies[i])) reached = false;
+      }
+    }));
+  }
+  for (auto& s : senders) s.join();
+  if (!reached) handOff(argv);
+
+  int res = 0;
+  vector<string> objs;
+  for (auto& reply : replies) {
+    cerr << reply["diagnostics"];
+    if (reply.count("asmfile")) {
+      ofstream(reply["asmfile"].c_str(), ios::binary) << reply["asm"];
+    }
+    if (reply.count("object")) {
+      ofstream(reply["objfile"].c_str(), ios::binary) << reply["object"];
+    }
+    objs.push_back(reply["objfile"]);
+    res = max(res, atoi(reply["status"].c_str()));
+  }
+  if (res != 0 || !program) return res;
+  return linkProgram(program, objs, libspl);
+}
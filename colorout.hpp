@@ -10,6 +10,13 @@ colorout out(1, 'r'); // r is for red
  * and then you can use that just like cout:
 out << "This is " << "all red!\n";
  * Note that cout still prints in the default color.
+ *
+ * Output is buffered, and each chunk is colored as a whole when it is
+ * written out: when the buffer fills, at the end of each line if the
+ * output is a terminal, and whenever the stream is flushed. A stream on
+ * file descriptor 2 is flushed after every output operation, like cerr.
+ * Like cerr and cout, an error stream can be tied to the result stream,
+ * so that results written earlier come out before the error.
  */
 
 #ifndef COLOROUT_HPP
@@ -18,13 +25,33 @@ out << "This is " << "all red!\n";
 #include <unistd.h> // for isatty
 #include <cstdlib>  // for exit
 #include <iostream>
+#include <cstring>  // for memcpy and memchr
 
 class colorbuf : public std::streambuf {
  private:
+  static const int BUFSIZE = 4096;
   int filedes;
   std::streambuf *dest;
   bool tty;
   char magic[7];
+  char buffer[BUFSIZE];
+
+  // Writes n bytes out, in color if this is a terminal.
+  bool writeOut(const char* s, std::streamsize n) {
+    if (n == 0) return true;
+    if (tty && dest->sputn(magic, 7) != 7) return false;
+    if (dest->sputn(s, n) != n) return false;
+    if (tty && dest->sputn("\033[0m", 4) != 4) return false;
+    return true;
+  }
+
+  // Writes out what is in the buffer, and empties it.
+  bool flushBuffer() {
+    bool ok = writeOut(pbase(), pptr() - pbase());
+    setp(buffer, buffer + BUFSIZE);
+    return ok;
+  }
+
  public:
   colorbuf (int fd, char color) {
     filedes = fd;
@@ -56,14 +83,41 @@ class colorbuf : public std::streambuf {
     magic[4] = ';';
     magic[5] = '1';
     magic[6] = 'm';
+
+    setp(buffer, buffer + BUFSIZE);
   }
 
+  ~colorbuf() { sync(); }
+
  protected:
+  // Called when a character doesn't fit in the buffer.
   virtual int overflow(int ch) {
-    if (tty) dest->sputn(magic, 7);
-    dest->sputc(ch);
-    if (tty) dest->sputn("\033[0m", 4);
-    return 1;
+    if (!flushBuffer()) return traits_type::eof();
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+    *pptr() = ch;
+    pbump(1);
+    if (tty && ch == '\n' && !flushBuffer()) return traits_type::eof();
+    return ch;
+  }
+
+  // Writes a whole string at once, straight out if it is too big to
+  // buffer.
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) {
+    if (n > epptr() - pptr()) {
+      if (!flushBuffer()) return 0;
+      if (n >= BUFSIZE) return writeOut(s, n) ? n : 0;
+    }
+    memcpy(pptr(), s, n);
+    pbump(n);
+    if (tty && memchr(s, '\n', n) && !flushBuffer()) return 0;
+    return n;
+  }
+
+  virtual int sync() {
+    if (!flushBuffer()) return -1;
+    return dest->pubsync();
   }
 };
 
@@ -71,9 +125,13 @@ class colorout : public std::ostream {
  private:
   colorbuf buf;
  public:
-  colorout(int fd, int cc)
+  // Anything waiting in tied is written out before each output here.
+  colorout(int fd, int cc, std::ostream* tied = NULL)
     :std::ostream(&buf), buf(fd,cc)
-    { }
+  {
+    if (fd == 2) setf(std::ios::unitbuf);
+    tie(tied);
+  }
 };
 
 #endif // COLOROUT_HPP
@@ -0,0 +1,286 @@
+/* Implementation of the compiler's library interface.
+ * The front end and code generator keep their state in an splContext
+ * and codeGenContext per compilation, so nothing here is shared between
+ * threads except the (file-locked) cache.
+ */
+
+#include "compile.hpp"
+#include "ast.hpp"
+#include "image.hpp"
+#include "spl.tab.hpp"
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+compileCache* cache = NULL;
+statsFormat statsReport = NO_STATS;
+bool profileGenerate = false;
+pgoProfile* profileUse = NULL;
+bool debugInfo = false;
+
+// A source file mapped into memory, so the scanner works on it in place
+// instead of copying it through stdio and its own buffers. The mapping is
+// private, so the NULs flex writes after each token only copy the pages
+// they touch, never the file.
+struct sourceMap {
+  char* base;
+  size_t size;
+  size_t mapped;
+
+  sourceMap() :base(NULL), size(0), mapped(0) { }
+  ~sourceMap() { if (base) munmap(base, mapped); }
+
+  // Returns false if fname is not a regular file that can be mapped.
+  bool open(const char* fname) {
+    int fd = ::open(fname, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      return false;
+    }
+    size = st.st_size;
+    long page = sysconf(_SC_PAGESIZE);
+    mapped = (size + 2 + page - 1) / page * page;
+    // Reserve room for the file and the two zero bytes flex needs after
+    // it, then map the file over the start of that.
+    void* p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED && size > 0
+        && mmap(p, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      munmap(p, mapped);
+      p = MAP_FAILED;
+    }
+    close(fd);
+    if (p == MAP_FAILED) return false;
+    base = (char*)p;
+    madvise(base, mapped, MADV_SEQUENTIAL);
+    return true;
+  }
+};
+
+// Parses and generates code for each top-level statement in turn,
+// writing each out and releasing its AST before going on to the next.
+static void generateAll(splContext& spl, codeGenContext& ctx) {
+  compileStats* stats = spl.stats;
+  while(! spl.error) {
+    spl.tree = NULL;
+    int res;
+    {
+      phaseTimer t(stats, PARSING);
+      res = yyparse(spl.scanner);
+    }
+    if (res != 0 || spl.error || spl.tree == NULL) break;
+    if (stats) spl.tree->countNodes(stats->nodes);
+    {
+      phaseTimer t(stats, TYPING);
+      inferTypes(spl.tree);
+    }
+    {
+      phaseTimer t(stats, CODEGEN);
+      if (ctx.instrument || ctx.profile) ctx.numberCounters(spl.tree);
+      ctx.markLine(spl.tree->getLine());
+      spl.tree->execCode(ctx);
+    }
+    {
+      phaseTimer t(stats, WRITING);
+      ctx.flushCode();
+    }
+    spl.arena.release();
+  }
+}
+
+// Writes out the statistics for one file all at once, so that files
+// compiled at the same time don't mix theirs up.
+static void reportStats(splContext& spl, codeGenContext& ctx,
+                        const char* fname) {
+  static mutex reportLock;
+  compileStats& stats = *spl.stats;
+  stats.literals = ctx.numlits;
+  stats.arenaAllocations = spl.arena.allocations;
+  stats.arenaBytes = spl.arena.bytes;
+  stats.arenaPeak = spl.arena.peak;
+  ostringstream out;
+  stats.write(out, fname, statsReport);
+  lock_guard<mutex> guard(reportLock);
+  cerr << out.str() << flush;
+}
+
+bool compileSource(const string& source, string& asmOut, string& diagnostics,
+                   bool allowImports, const char* name, bool debug) {
+  splContext spl;
+  useContext use(spl);
+  stringbuf diag;
+  streambuf* console = errout.rdbuf(&diag);
+
+  codeGenContext ctx;
+  ctx.allowImports = allowImports;
+  if (name) ctx.sourceName = name;
+  ctx.debugInfo = debug;
+  ctx.startCode();
+  switchbuf(source.c_str(), spl.scanner);
+  generateAll(spl, ctx);
+  delbuf(spl.scanner);
+  ostringstream out;
+  ctx.generateCode(out);
+  asmOut = out.str();
+
+  errout.rdbuf(console);
+  diagnostics = diag.str();
+  return !spl.error;
+}
+
+void execute(Stmt* tree, VM* vm, imageWriter* image) {
+  inferTypes(tree);
+  if (vm) {
+    Bytecode bc;
+    tree->execBC(bc);
+    bc.emit(HALT);
+    vm->run(bc);
+    if (image) image->add(bc);
+  }
+  else {
+    profileTimer t(state().profiler, tree);
+    tree->exec();
+  }
+}
+
+int interpretSource(const string& source, const string& input,
+                    string& output, string& diagnostics, VM* vm) {
+  splContext spl;
+  useContext use(spl);
+  stringbuf out, diag;
+  istringstream in(input);
+  ostream prompt(&out);
+  spl.input = &in;
+  spl.prompt = &prompt;
+  resout.flush();
+  streambuf* console = resout.rdbuf(&out);
+  streambuf* errConsole = errout.rdbuf(&diag);
+
+  switchbuf(source.c_str(), spl.scanner);
+  while (true) {
+    spl.tree = NULL;
+    spl.error = false;
+    yyparse(spl.scanner);
+    if (spl.tree == NULL) break;
+    execute(spl.tree, vm);
+    spl.failed |= spl.error;
+    spl.arena.release();
+  }
+  delbuf(spl.scanner);
+
+  resout.flush();
+  resout.rdbuf(console);
+  errout.rdbuf(errConsole);
+  output = out.str();
+  diagnostics = diag.str();
+  return spl.error || spl.failed ? 1 : 0;
+}
+
+int compileFile(const char* fname, bool allowImports, bool assemble) {
+  compileStats stats; // from the start, but only used with --stats
+  string asmfile = outputName(fname, ".asm");
+  string objfile = outputName(fname, ".o");
+  sourceMap src;
+  FILE* in = NULL;
+  if (!src.open(fname) && !(in = fopen(fname,"r"))) {
+    cerr << "Could not open input file \"" << fname << "\"!" << endl;
+    return 2;
+  }
+  string key;
+  bool pgo = profileGenerate || profileUse;
+  if (cache && src.base && !pgo) {
+    string options = allowImports ? "imports" : "";
+    // The debug info names the source file, so its name is part of the key.
+    if (debugInfo) options += string(" -g ") + fname;
+    key = compileCache::key(src.base, src.size, options);
+    bool hit = cache->fetch(key, ".asm", asmfile)
+            && (!assemble || cache->fetch(key, ".o", objfile));
+    cache->record(hit);
+    if (hit) return 0;
+  }
+  // This is the non-interactive version of the interpreter.
+  // It exits with return code 5 if there is any kind of error,
+  // and doesn't display prompts or other niceties.
+  splContext spl(in);
+  useContext use(spl);
+  if (statsReport != NO_STATS) spl.stats = &stats;
+  if (src.base) scanbuf(src.base, src.size, spl.scanner);
+  codeGenContext ctx;
+  ctx.allowImports = allowImports;
+  ctx.sourceName = fname;
+  ctx.debugInfo = debugInfo;
+  if (pgo) {
+    // Counts are matched to modules by their source, so a module that
+    // has changed since it was profiled is compiled as if it wasn't.
+    ctx.profileKey = src.base ? compileCache::key(src.base, src.size, "pgo") : "-";
+    ctx.instrument = profileGenerate;
+    if (profileUse && !(ctx.profile = profileUse->find(ctx.profileKey))) {
+      cerr << "No profile for " << fname << " as it is now" << endl;
+    }
+  }
+  ctx.startCode(fname);
+  generateAll(spl, ctx);
+  if (in) fclose(in);
+  {
+    phaseTimer t(spl.stats, EMITTING);
+    ctx.generateCode(fname);
+  }
+  int res = spl.error ? 5 : 0;
+  if (res == 0 && assemble) {
+    phaseTimer t(spl.stats, ASSEMBLING);
+    vector<const char*> nasm = {"nasm", "-felf", asmfile.c_str(), "-o", objfile.c_str()};
+    if (debugInfo) nasm.insert(nasm.end(), {"-g", "-F", "dwarf"});
+    nasm.push_back(NULL);
+    if (runCommand(nasm.data()) != 0) res = 5;
+  }
+  if (res == 0 && !key.empty()) {
+    cache->store(key, ".asm", asmfile);
+    if (assemble) cache->store(key, ".o", objfile);
+  }
+  if (spl.stats) reportStats(spl, ctx, fname);
+  return res;
+}
+
+int compileAll(const vector<const char*>& files, int jobs,
+               bool allowImports, bool assemble) {
+  atomic<unsigned> next(0);
+  int result = 0;
+  mutex resultLock;
+  vector<thread> workers;
+  for (int j = 0; j < jobs && j < (int)files.size(); ++j) {
+    workers.push_back(thread([&]() {
+      for (unsigned i = next++; i < files.size(); i = next++) {
+        int code = compileFile(files[i], allowImports, assemble);
+        lock_guard<mutex> guard(resultLock);
+        if (code > result) result = code;
+      }
+    }));
+  }
+  for (auto& w : workers) w.join();
+  return result;
+}
+
+int runCommand(const char* const* args) {
+  // Several threads may be compiling at once, so the child is started
+  // with posix_spawn rather than a fork that would copy their locks.
+  pid_t pid;
+  if (posix_spawnp(&pid, args[0], NULL, NULL, (char* const*)args, environ)
+      != 0) {
+    cerr << "Could not run " << args[0] << endl;
+    return 127;
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) return -1;
+  return WEXITSTATUS(status);
+}
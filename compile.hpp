@@ -0,0 +1,69 @@
+/* C++ header file for compiling SPL programs.
+ * These functions are the library interface to the compiler: each
+ * compilation has its own splContext, so they may be called from
+ * several threads at once.
+ */
+
+#ifndef COMPILE_HPP
+#define COMPILE_HPP
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "cache.hpp"
+#include "stats.hpp"
+#include "pgo.hpp"
+
+// The compilation cache, if one is in use.
+extern compileCache* cache;
+
+// How compileFile reports statistics for each file it compiles (files
+// found in the cache are not reported).
+extern statsFormat statsReport;
+
+// Set by --profile-generate, to instrument every module compiled for a
+// profile; set by --profile-use to the profile to optimize them with.
+// Neither kind of module is put in or taken from the cache.
+extern bool profileGenerate;
+extern pgoProfile* profileUse;
+
+// Set by -g, to give the .asm files the source line of each instruction
+// (with nasm's %line), and assemble them with DWARF debug info.
+extern bool debugInfo;
+
+class Stmt;
+class VM;
+class imageWriter;
+
+// Compiles SPL source text to assembly code in asmOut, with any error
+// messages in diagnostics. Returns false if there were errors. With
+// debug, the code is given the lines of the source file name.
+bool compileSource(const string& source, string& asmOut, string& diagnostics,
+                   bool allowImports = false, const char* name = NULL,
+                   bool debug = false);
+
+// Runs a parsed statement, on the bytecode VM if there is one, and
+// adds its bytecode to the program image, if one is being made.
+void execute(Stmt* tree, VM* vm, imageWriter* image = NULL);
+
+// Interprets SPL source text as a script, reading from input, with its
+// output and error messages in output and diagnostics. Returns 1 if it
+// fails to parse or has an error when it runs, like --run.
+int interpretSource(const string& source, const string& input,
+                    string& output, string& diagnostics, VM* vm = NULL);
+
+// Compiles one SPL source file to a .asm file next to it, and
+// additionally assembles it to a .o if assemble is set.
+// Returns 0 on success, or the exit code to report.
+int compileFile(const char* fname, bool allowImports, bool assemble);
+
+// Compiles every file with compileFile, up to jobs of them at a time.
+// Returns the worst of their exit codes.
+int compileAll(const vector<const char*>& files, int jobs,
+               bool allowImports, bool assemble);
+
+// Runs an external program (nasm, ld) and returns its exit status.
+int runCommand(const char* const* args);
+
+#endif // COMPILE_HPP
@@ -0,0 +1,171 @@
+/* C++ header file for the per-compilation context.
+ * Everything that belongs to one compilation or interpreter session lives
+ * in an splContext, so that several can run at once on different threads.
+ */
+
+#ifndef CONTEXT_HPP
+#define CONTEXT_HPP
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+using namespace std;
+
+#include "value.hpp"
+#include "intern.hpp"
+#include "arena.hpp"
+#include "st.hpp"
+#include "vm.hpp"
+#include "jit.hpp"
+#include "stats.hpp"
+#include "profile.hpp"
+
+class Stmt;
+class Fun;
+
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void* yyscan_t;
+#endif
+
+// These are implemented in the scanner (spl.lpp).
+// A scanner made with no file reads from buffers given to switchbuf.
+yyscan_t openScanner(FILE* in);
+void closeScanner(yyscan_t scanner);
+
+struct splContext {
+  // The scanner, and the statement the parser most recently finished.
+  yyscan_t scanner;
+  Stmt* tree;
+
+  // Set once an error has occurred. The interpreter clears it before
+  // each top-level statement, but failed stays set once any has had one.
+  bool error;
+  bool failed;
+
+  // Indicates there is a human typing at a keyboard.
+  bool showPrompt;
+
+  // Where read takes numbers from, and writes its prompt.
+  istream* input;
+  ostream* prompt;
+
+  // The names of the identifiers parsed so far, which symbols stand for.
+  Interner names;
+
+  // The interpreter's variables, keyed by slot. Every name is given a
+  // small slot number when an Id for it is parsed, so running the
+  // program never hashes names.
+  SymbolTable<Value> vars;
+  symbolMap<int> slots;
+  int numSlots;
+  vector<symbol> slotNames; // the name given each slot, in order
+
+  // Returns the slot for the named variable, adding one if needed.
+  int slot(symbol name) {
+    int& s = slots[name];
+    if (s == 0) {
+      s = ++numSlots; // stored one higher, so 0 means "none yet"
+      slotNames.push_back(name);
+    }
+    return s - 1;
+  }
+
+  // What type inference knows from the statements before this one: the
+  // type each function returns and each global variable has (NONE_T if
+  // it could be any), and the variables that some function assigns to
+  // without declaring them, whose types can't be known anywhere else.
+  symbolMap<VType> returnTypes;
+  symbolMap<VType> globalTypes;
+  vector<bool> assignedInFuns;
+
+  // The functions defined so far, and the bytecode compiled for them.
+  symbolMap<Fun*> funs;
+  deque<Bytecode> funcode;
+
+  // Each call in progress has an activation record: a table of its own
+  // local variables. Globals are still found in vars. The tables are
+  // kept for reuse after their calls return, so once the stack has been
+  // this deep before, a call allocates nothing.
+  deque<SymbolTable<Value> > frames;
+  unsigned callDepth;
+  SymbolTable<Value>* locals; // the innermost call's, or NULL
+
+  // Set by a return statement, until its call has finished unwinding.
+  bool returning;
+  Value retval;
+
+  // The table new variables are bound in.
+  SymbolTable<Value>& scope() { return locals ? *locals : vars; }
+
+  // Finds a variable: a local of the current call, or else a global.
+  Value* lookup(int slot) {
+    if (locals) {
+      if (Value* v = locals->lookup(slot)) return v;
+    }
+    return vars.lookup(slot);
+  }
+
+  // Starts a call, with its argument bound to the given slot.
+  void enterCall(int param, const Value& arg) {
+    if (callDepth == frames.size()) frames.emplace_back();
+    locals = &frames[callDepth++];
+    locals->bind(param, arg);
+  }
+
+  // Finishes the innermost call.
+  void leaveCall() {
+    locals->clear();
+    --callDepth;
+    locals = callDepth ? &frames[callDepth - 1] : NULL;
+    returning = false;
+  }
+
+  // What the compiler counts and times, with --stats; otherwise NULL.
+  compileStats* stats;
+
+  // What the tree walker counts and times, with --profile; otherwise NULL.
+  Profiler* profiler;
+
+  // Compiles the hot parts of the program, for the tree walker.
+  Jit jit;
+
+  // Holds the AST. Released after each top-level statement is done with.
+  Arena arena;
+
+  // Holds the arrays the program makes, which are never freed before
+  // the context is.
+  Arena heap;
+
+  splContext(FILE* in = NULL)
+    :scanner(openScanner(in)), tree(NULL), error(false), failed(false),
+     showPrompt(false),
+     input(&cin), prompt(&cout), numSlots(0), callDepth(0), locals(NULL), returning(false), stats(NULL),
+     profiler(NULL) { }
+  ~splContext() { closeScanner(scanner); }
+
+  // The context the current thread is working on.
+  static thread_local splContext* current;
+
+  private:
+    splContext(const splContext&);
+    splContext& operator=(const splContext&);
+};
+
+// Returns the context the current thread is working on.
+inline splContext& state() { return *splContext::current; }
+
+// Makes ctx the current thread's context for as long as it is in scope.
+class useContext {
+  private:
+    splContext* prev;
+  public:
+    useContext(splContext& ctx) :prev(splContext::current) {
+      splContext::current = &ctx;
+    }
+    ~useContext() { splContext::current = prev; }
+};
+
+#endif // CONTEXT_HPP
@@ -0,0 +1,357 @@
+/* Implementation of precompiled program images.
+ * The image is mapped privately and writably: linking it gives each call
+ * the symbol its function has in this process, which only copies the
+ * pages with calls on them, never the file.
+ */
+
+#include "image.hpp"
+#include "ast.hpp"
+#include "cache.hpp"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool imageWriter::copy(Bytecode& bc, unit& u) {
+  u.maxDepth = bc.maxDepth;
+  u.inFunction = bc.inFunction;
+  for (const char* s : bc.strings) u.strings.push_back(s);
+  // Function definitions are the only statements the VM leaves to the
+  // tree walker that an image can hold: their bodies are saved too.
+  for (AST* node : bc.nodes) {
+    Fun* f = dynamic_cast<Fun*>(node);
+    if (!f || bc.inFunction) return false;
+    fun d;
+    d.name = f->getName();
+    d.param = symbolName(f->getVar());
+    d.unit = bodies.size();
+    bodies.push_back(unit());
+    if (!copy(f->getBC(), bodies.back())) return false;
+    u.nodes.push_back(funs.size());
+    funs.push_back(d);
+  }
+  u.code = bc.code;
+  for (size_t pc = 0; pc < u.code.size(); pc += 1 + numOperands[u.code[pc]]) {
+    if (u.code[pc] == EVALNODE) return false;
+    if (u.code[pc] == CALLOP) {
+      int& n = nameIndex[u.code[pc + 1]];
+      if (n == 0) {
+        names.push_back(symbolName(u.code[pc + 1]));
+        n = names.size();
+      }
+      u.code[pc + 1] = n - 1;
+    }
+  }
+  return true;
+}
+
+void imageWriter::add(Bytecode& bc) {
+  if (!ok) return;
+  top.push_back(unit());
+  ok = copy(bc, top.back());
+}
+
+// Appends n bytes to an image, 4-byte aligned, and returns their offset.
+static uint32_t put(string& out, const void* p, size_t n) {
+  out.resize((out.size() + 3) & ~(size_t)3);
+  uint32_t off = out.size();
+  if (n) out.append((const char*)p, n);
+  return off;
+}
+
+static uint32_t put(string& out, const string& s) {
+  return put(out, s.c_str(), s.size() + 1);
+}
+
+static uint32_t put(string& out, const vector<uint32_t>& table) {
+  return put(out, table.data(), table.size() * sizeof(uint32_t));
+}
+
+// Hashes the words of an image after its header, so that one damaged
+// since it was written isn't run.
+static uint32_t checksum(const char* base, size_t size) {
+  const uint32_t* w = (const uint32_t*)(base + sizeof(imageHeader));
+  const uint32_t* end = (const uint32_t*)(base + size);
+  unsigned long long h = 14695981039346656037ULL;
+  for (; w < end; ++w) h = (h ^ *w) * 1099511628211ULL;
+  return h ^ (h >> 32);
+}
+
+bool imageWriter::write(const vector<symbol>& slotNames) {
+  if (!ok) return false;
+  imageHeader h;
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, IMAGE_MAGIC, sizeof h.magic);
+  h.format = IMAGE_FORMAT;
+  strncpy(h.version, SPL_VERSION, sizeof h.version - 1);
+  strncpy(h.key, key.c_str(), sizeof h.key - 1);
+  string out(sizeof h, '\0');
+
+  vector<uint32_t> table;
+  for (symbol s : slotNames) table.push_back(put(out, symbolName(s)));
+  h.numSlots = table.size();
+  h.slots = put(out, table);
+  table.clear();
+  for (auto& n : names) table.push_back(put(out, n));
+  h.numNames = table.size();
+  h.names = put(out, table);
+
+  vector<imageFun> fs;
+  for (auto& f : funs) {
+    imageFun e = { put(out, f.name), put(out, f.param),
+                   (uint32_t)(top.size() + f.unit) };
+    fs.push_back(e);
+  }
+  h.numFuns = fs.size();
+  h.funs = put(out, fs.data(), fs.size() * sizeof(imageFun));
+
+  vector<imageUnit> us;
+  for (unsigned i = 0; i < top.size() + bodies.size(); ++i) {
+    unit& u = i < top.size() ? top[i] : bodies[i - top.size()];
+    imageUnit e;
+    e.code = put(out, u.code.data(), u.code.size() * sizeof(int));
+    e.length = u.code.size();
+    e.maxDepth = u.maxDepth;
+    e.inFunction = u.inFunction;
+    table.clear();
+    for (auto& s : u.strings) table.push_back(put(out, s));
+    e.numStrings = table.size();
+    e.strings = put(out, table);
+    table.assign(u.nodes.begin(), u.nodes.end());
+    e.numNodes = table.size();
+    e.nodes = put(out, table);
+    us.push_back(e);
+  }
+  h.numUnits = us.size();
+  h.units = put(out, us.data(), us.size() * sizeof(imageUnit));
+  h.numTop = top.size();
+  h.size = out.size();
+  h.check = checksum(out.data(), out.size());
+  memcpy(&out[0], &h, sizeof h);
+
+  // Written to the side and renamed into place, so that a script run
+  // at the same time never maps half an image.
+  ostringstream tmp;
+  tmp << fname << ".tmp." << getpid();
+  {
+    ofstream f(tmp.str().c_str(), ios::binary);
+    f.write(out.data(), out.size());
+    if (!f) {
+      remove(tmp.str().c_str());
+      return false;
+    }
+  }
+  return rename(tmp.str().c_str(), fname.c_str()) == 0;
+}
+
+programImage::~programImage() {
+  if (base) munmap(base, size);
+}
+
+const char* programImage::str(uint32_t off) {
+  if (off >= size || !memchr(base + off, 0, size - off)) return NULL;
+  return base + off;
+}
+
+bool programImage::table(uint32_t off, uint32_t n, size_t entry) {
+  return off % 4 == 0 && off <= size && n <= (size - off) / entry;
+}
+
+bool programImage::link(int* code, uint32_t length, const imageUnit& u,
+                        const vector<symbol>& names, int& maxDepth) {
+  splContext& spl = state();
+  vector<bool> starts(length);
+  uint32_t pc = 0;
+  while (pc < length) {
+    starts[pc] = true;
+    int op = code[pc];
+    if (op < 0 || op >= NUMOPS || op == EVALNODE
+        || length - pc <= (uint32_t)numOperands[op]) {
+      return false;
+    }
+    const int* a = code + pc + 1;
+    switch (op) {
+      case LOAD: case STORE: case BINDVAR:
+        if (a[0] < 0 || a[0] >= spl.numSlots) return false;
+        break;
+      case NEWVAR: case SETVAR:
+        if (a[0] < 0 || a[0] >= spl.numSlots) return false;
+        if (a[1] < 0 || (uint32_t)a[1] >= length) return false;
+        break;
+      case ANDJ: case ORJ: case JUMP: case JFALSE:
+        if (a[0] < 0 || (uint32_t)a[0] >= length) return false;
+        break;
+      case WRITESTR:
+        if (a[0] < 0 || (uint32_t)a[0] >= u.numStrings) return false;
+        break;
+      case EXECNODE:
+        if (a[0] < 0 || (uint32_t)a[0] >= u.numNodes) return false;
+        break;
+      case CALLOP:
+        if (a[0] < 0 || (uint32_t)a[0] >= names.size()) return false;
+        code[pc + 1] = names[a[0]];
+        break;
+    }
+    pc += 1 + numOperands[op];
+  }
+  // The code must end the way the VM expects it to.
+  Opcode last = u.inFunction ? RETOP : HALT;
+  if (length == 0 || !starts[length - 1] || code[length - 1] != last) {
+    return false;
+  }
+
+  // Follows every path through the code, with the depth of the stack
+  // before each instruction, rather than trusting the depth in the file.
+  vector<int> depth(length, -1);
+  vector<uint32_t> todo;
+  maxDepth = 0;
+  depth[0] = 0;
+  todo.push_back(0);
+  auto reach = [&](int target, int d) {
+    if (target < 0 || (uint32_t)target >= length || !starts[target]) {
+      return false;
+    }
+    if (depth[target] < 0) {
+      depth[target] = d;
+      todo.push_back(target);
+    }
+    return depth[target] == d;
+  };
+  while (!todo.empty()) {
+    pc = todo.back();
+    todo.pop_back();
+    int op = code[pc], d = depth[pc];
+    if (d < stackUse[op]) return false;
+    int after = d + stackEffect[op];
+    if (after > maxDepth) maxDepth = after;
+    const int* a = code + pc + 1;
+    uint32_t next = pc + 1 + numOperands[op];
+    switch (op) {
+      case HALT:
+        if (d != 0) return false;
+        break;
+      case RETOP:
+        if (d != 1) return false;
+        break;
+      case JUMP:
+        if (!reach(a[0], d)) return false;
+        break;
+      case ANDJ: case ORJ: // the value stays on the stack if they jump
+        if (!reach(a[0], d) || !reach(next, after)) return false;
+        break;
+      case JFALSE:
+        if (!reach(a[0], after) || !reach(next, after)) return false;
+        break;
+      case NEWVAR: case SETVAR:
+        if (!reach(a[1], d) || !reach(next, after)) return false;
+        break;
+      default:
+        if (!reach(next, after)) return false;
+    }
+  }
+  return true;
+}
+
+bool programImage::open(const char* fname, const string& key) {
+  int fd = ::open(fname, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+      || st.st_size < (off_t)sizeof(imageHeader)) {
+    close(fd);
+    return false;
+  }
+  size = st.st_size;
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return false;
+  base = (char*)p;
+
+  const imageHeader& h = *(const imageHeader*)base;
+  if (memcmp(h.magic, IMAGE_MAGIC, sizeof h.magic) != 0
+      || h.format != IMAGE_FORMAT
+      || strncmp(h.version, SPL_VERSION, sizeof h.version) != 0
+      || key.size() >= sizeof h.key
+      || strncmp(h.key, key.c_str(), sizeof h.key) != 0
+      || h.size != size || size % 4 != 0
+      || h.check != checksum(base, size)) {
+    return false;
+  }
+  if (!table(h.slots, h.numSlots, sizeof(uint32_t))
+      || !table(h.names, h.numNames, sizeof(uint32_t))
+      || !table(h.funs, h.numFuns, sizeof(imageFun))
+      || !table(h.units, h.numUnits, sizeof(imageUnit))
+      || h.numTop > h.numUnits) {
+    return false;
+  }
+
+  // The variables get back the slots their code uses.
+  splContext& spl = state();
+  const uint32_t* slots = (const uint32_t*)(base + h.slots);
+  for (uint32_t i = 0; i < h.numSlots; ++i) {
+    const char* name = str(slots[i]);
+    if (!name || spl.slot(intern(name, strlen(name))) != (int)i) return false;
+  }
+  vector<symbol> names;
+  const uint32_t* nameOffs = (const uint32_t*)(base + h.names);
+  for (uint32_t i = 0; i < h.numNames; ++i) {
+    const char* name = str(nameOffs[i]);
+    if (!name) return false;
+    names.push_back(intern(name, strlen(name)));
+  }
+  vector<Fun*> funs;
+  const imageFun* fs = (const imageFun*)(base + h.funs);
+  for (uint32_t i = 0; i < h.numFuns; ++i) {
+    const char* name = str(fs[i].name);
+    const char* param = str(fs[i].param);
+    if (!name || !param || fs[i].unit < h.numTop || fs[i].unit >= h.numUnits) {
+      return false;
+    }
+    funs.push_back(new Fun(new Id(name), new Id(param), NULL));
+  }
+
+  const imageUnit* us = (const imageUnit*)(base + h.units);
+  for (uint32_t i = 0; i < h.numUnits; ++i) {
+    const imageUnit& u = us[i];
+    if (!table(u.code, u.length, sizeof(int))
+        || !table(u.strings, u.numStrings, sizeof(uint32_t))
+        || !table(u.nodes, u.numNodes, sizeof(uint32_t))
+        || (u.inFunction != 0) != (i >= h.numTop)) {
+      return false;
+    }
+    units.push_back(Bytecode(u.inFunction));
+    Bytecode& bc = units.back();
+    bc.mapped = (const int*)(base + u.code);
+    const uint32_t* strings = (const uint32_t*)(base + u.strings);
+    for (uint32_t j = 0; j < u.numStrings; ++j) {
+      const char* s = str(strings[j]);
+      if (!s) return false;
+      bc.strings.push_back(s);
+    }
+    const uint32_t* nodes = (const uint32_t*)(base + u.nodes);
+    for (uint32_t j = 0; j < u.numNodes; ++j) {
+      if (nodes[j] >= funs.size()) return false;
+      bc.nodes.push_back(funs[nodes[j]]);
+    }
+    if (!link((int*)(base + u.code), u.length, u, names, bc.maxDepth)) {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h.numFuns; ++i) funs[i]->setBC(&units[fs[i].unit]);
+  numTop = h.numTop;
+  return true;
+}
+
+int programImage::run(VM& vm) {
+  splContext& spl = state();
+  for (unsigned i = 0; i < numTop; ++i) {
+    spl.error = false;
+    vm.run(units[i]);
+    spl.failed |= spl.error;
+  }
+  return spl.failed ? 1 : 0;
+}
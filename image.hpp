@@ -0,0 +1,133 @@
+/* C++ header file for precompiled program images.
+ * A script run on the VM can be saved as an image: the bytecode of each
+ * of its top-level statements and functions, with the names of its
+ * variables and functions. Running the script again maps the image into
+ * memory and runs the bytecode from there, without scanning, parsing or
+ * compiling it again.
+ */
+
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+using namespace std;
+
+#include "context.hpp"
+
+// Bump this whenever the layout below or the opcodes change.
+#define IMAGE_FORMAT 2
+#define IMAGE_MAGIC "SPLIMG\r\n"
+
+/* An image is one block of memory, and refers within itself only by
+ * offsets from its start, so it can be mapped anywhere. Every table is
+ * 4-byte aligned, and every string ends in a NUL.
+ */
+struct imageHeader {
+  char magic[8];
+  uint32_t format;       // IMAGE_FORMAT
+  char version[20];      // SPL_VERSION
+  char key[36];          // of the source, as compileCache::key gives it
+  uint32_t size;         // of the whole image, in bytes
+  uint32_t check;        // a hash of everything after the header
+  uint32_t numSlots, slots; // the name of each variable slot, in order
+  uint32_t numNames, names; // the functions called by name
+  uint32_t numFuns, funs;   // imageFuns
+  uint32_t numUnits, units; // imageUnits, the top-level statements first
+  uint32_t numTop;
+};
+
+// A function definition, with the unit that is its body.
+struct imageFun {
+  uint32_t name, param, unit;
+};
+
+/* The code for a statement or function. A CALLOP's operand is an index
+ * into the image's names, and an EXECNODE's node is a function
+ * definition, given by its index into the image's functions.
+ */
+struct imageUnit {
+  uint32_t code, length; // the instructions, and how many ints they take
+  uint32_t maxDepth, inFunction;
+  uint32_t numStrings, strings;
+  uint32_t numNodes, nodes;
+};
+
+/* Builds an image from the bytecode of a script as it runs. Anything
+ * the VM leaves to the tree walker, other than defining a function,
+ * can't be saved, and then no image is written.
+ */
+class imageWriter {
+  private:
+    struct unit {
+      vector<int> code;
+      int maxDepth;
+      bool inFunction;
+      vector<string> strings;
+      vector<int> nodes;
+    };
+    struct fun {
+      string name, param;
+      unsigned unit;
+    };
+    vector<unit> top, bodies;
+    vector<fun> funs;
+    vector<string> names;
+    symbolMap<int> nameIndex; // stored one higher, like slots
+    string fname, key; // where to write the image, and the source's key
+    bool ok;
+
+    // Copies bc's code into u. Returns false if it can't be saved.
+    bool copy(Bytecode& bc, unit& u);
+
+  public:
+    imageWriter(const string& f, const string& k) :fname(f), key(k), ok(true) { }
+
+    // Adds a top-level statement, after it has run.
+    void add(Bytecode& bc);
+
+    // Writes the image, with the names of the variable slots, unless
+    // some statement couldn't be saved. Returns whether it did.
+    bool write(const vector<symbol>& slotNames);
+};
+
+/* An image mapped into memory, and set up to run in the current
+ * splContext, which must not have parsed anything yet.
+ */
+class programImage {
+  private:
+    char* base;
+    size_t size;
+    deque<Bytecode> units;
+    unsigned numTop;
+
+    // Returns the string at off, or NULL if it isn't in the image.
+    const char* str(uint32_t off);
+
+    // Checks a table of n entries of the given size at off.
+    bool table(uint32_t off, uint32_t n, size_t entry);
+
+    // Checks the operands of the code for one unit, and gives each
+    // CALLOP the symbol of the function it calls. Every jump must land
+    // on an instruction, with the stack as deep as on every other way
+    // there, and maxDepth gets the deepest the stack can go.
+    bool link(int* code, uint32_t length, const imageUnit& u,
+              const vector<symbol>& names, int& maxDepth);
+
+  public:
+    programImage() :base(NULL), size(0), numTop(0) { }
+    ~programImage();
+
+    // Maps the image in fname, and sets it up to run. Returns false if
+    // it can't be read, or wasn't made by this version of the compiler
+    // from the source with the given key.
+    bool open(const char* fname, const string& key);
+
+    // Runs the top-level statements in turn. Returns 1 if any of them
+    // had an error, as runScript does.
+    int run(VM& vm);
+};
+
+#endif // IMAGE_HPP
@@ -0,0 +1,50 @@
+/* Implementation of the identifier interner.
+ * Looking up a name that is already there allocates nothing.
+ */
+
+#include "intern.hpp"
+#include "context.hpp"
+#include <cstring>
+
+static size_t hashName(const char* name, size_t len) {
+  size_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Finds the slot in table for name: either its symbol, or empty.
+size_t Interner::slotFor(const char* name, size_t len) const {
+  size_t mask = table.size() - 1;
+  for (size_t i = hashName(name, len) & mask; ; i = (i + 1) & mask) {
+    symbol s = table[i];
+    if (s == NOSYM) return i;
+    const string& n = names[s];
+    if (n.size() == len && memcmp(n.data(), name, len) == 0) return i;
+  }
+}
+
+symbol Interner::intern(const char* name, size_t len) {
+  if ((names.size() + 1) * 2 > table.size()) {
+    table.assign(table.empty() ? 1024 : table.size() * 2, NOSYM);
+    for (symbol s = 0; s < names.size(); ++s) {
+      table[slotFor(names[s].data(), names[s].size())] = s;
+    }
+  }
+  size_t i = slotFor(name, len);
+  if (table[i] == NOSYM) {
+    table[i] = names.size();
+    names.push_back(string(name, len));
+  }
+  return table[i];
+}
+
+symbol intern(const char* name, size_t len) {
+  return state().names.intern(name, len);
+}
+
+const string& symbolName(symbol s) {
+  return state().names.name(s);
+}
@@ -0,0 +1,109 @@
+/* C++ header file for identifier interning.
+ * Every identifier's name is stored once, in the interner of the context
+ * being compiled, and is represented everywhere else by a small integer
+ * symbol. Symbol tables are then keyed on integers instead of strings.
+ */
+
+#ifndef INTERN_HPP
+#define INTERN_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+using namespace std;
+
+typedef unsigned symbol;
+
+// Never returned by intern(); marks empty slots in a symbolMap.
+const symbol NOSYM = ~0u;
+
+/* The names of one context's symbols. Names live in a deque, so
+ * references to them stay valid as it grows, and are found through an
+ * open-addressing table of symbols hashed on the name's bytes. A context
+ * is only used by one thread at a time, so this needs no lock, and it
+ * is freed with the context.
+ */
+class Interner {
+  private:
+    deque<string> names;
+    vector<symbol> table; // symbols hashed by name; size a power of two
+
+    size_t slotFor(const char* name, size_t len) const;
+
+  public:
+    // Returns the symbol for the given name, adding it if it is new.
+    symbol intern(const char* name, size_t len);
+
+    const string& name(symbol s) const { return names[s]; }
+};
+
+// Returns the symbol for the given name in the current thread's
+// context, adding it if it is new.
+symbol intern(const char* name, size_t len);
+inline symbol intern(const string& name) {
+  return intern(name.data(), name.size());
+}
+
+// Returns the name of a symbol in the current thread's context.
+const string& symbolName(symbol s);
+
+/* A hash table from symbols to T, stored flat in one array with
+ * linear probing. Symbols are already small distinct integers, so a
+ * lookup is a multiply, a mask and usually a single comparison.
+ */
+template <class T>
+class symbolMap {
+  private:
+    struct slot {
+      symbol key;
+      T val;
+      slot() :key(NOSYM), val() { }
+    };
+    vector<slot> slots; // size is zero or a power of two
+    size_t used;
+
+    size_t home(symbol s) const {
+      return (s * 2654435761u) & (slots.size() - 1);
+    }
+
+    void grow() {
+      vector<slot> old(slots.size() ? slots.size() * 2 : 8);
+      old.swap(slots);
+      for (auto& e : old) {
+        if (e.key == NOSYM) continue;
+        size_t i = home(e.key);
+        while (slots[i].key != NOSYM) i = (i + 1) & (slots.size() - 1);
+        slots[i] = e;
+      }
+    }
+
+  public:
+    symbolMap() :used(0) { }
+
+    // Returns the value bound to s, or NULL if there is none.
+    T* find(symbol s) {
+      if (slots.empty()) return NULL;
+      for (size_t i = home(s); ; i = (i + 1) & (slots.size() - 1)) {
+        if (slots[i].key == s) return &slots[i].val;
+        if (slots[i].key == NOSYM) return NULL;
+      }
+    }
+
+    bool count(symbol s) { return find(s) != NULL; }
+
+    // Returns the value bound to s, adding a default one if needed.
+    T& operator[](symbol s) {
+      if (T* v = find(s)) return *v;
+      if ((used + 1) * 4 > slots.size() * 3) grow();
+      size_t i = home(s);
+      while (slots[i].key != NOSYM) i = (i + 1) & (slots.size() - 1);
+      slots[i].key = s;
+      ++used;
+      return slots[i].val;
+    }
+
+    size_t size() const { return used; }
+};
+
+#endif // INTERN_HPP
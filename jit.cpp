@@ -0,0 +1,361 @@
+/* Implementation of the just-in-time compiler.
+ * The code is x86-64 for the System V ABI. A function is called as
+ * int f(int arg), and a loop as void loop(Value** vars), where vars
+ * holds the loop's variables from outside of it.
+ *
+ * Every frame looks the same:
+ *     push rbp
+ *     mov rbp, rsp
+ *     push rbx            ; [rbp-8]: rbx holds vars, in a loop
+ *     sub rsp, N          ; the variables, at [rbp-16], [rbp-24], ...
+ * and N keeps rsp aligned to 16 bytes, as calls need it to be. Values
+ * pushed in the middle of an expression are counted, so that calls made
+ * while there is one pushed can be aligned too.
+ */
+
+#include "jit.hpp"
+#include "ast.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
+#include <mutex>
+
+#if defined(__x86_64__)
+bool Jit::enabled = true;
+#else
+bool Jit::enabled = false;
+#endif
+bool Jit::perfMap = false;
+
+// Adds a line for some code to the map perf reads for this process.
+// Every context's Jit adds to the same file.
+static void addToPerfMap(const void* entry, size_t size, const string& name) {
+  static mutex lock;
+  static FILE* map = NULL;
+  lock_guard<mutex> guard(lock);
+  if (!map) {
+    char fname[64];
+    snprintf(fname, sizeof fname, "/tmp/perf-%d.map", (int)getpid());
+    if (!(map = fopen(fname, "a"))) return;
+  }
+  fprintf(map, "%lx %zx %s\n", (unsigned long)entry, size, name.c_str());
+  fflush(map);
+}
+
+// These are called from the compiled code, to do just what the
+// interpreter does.
+
+static void writeNum(int n, int newline) {
+  if (!state().error) {
+    resout << n;
+    if (newline) resout << '\n';
+  }
+}
+
+static void writeBool(int b, int newline) {
+  if (!state().error) {
+    Value(b != 0).writeTo(resout);
+    if (newline) resout << '\n';
+  }
+}
+
+static void writeString(const char* s, int newline) {
+  if (!state().error) {
+    resout << s;
+    if (newline) resout << '\n';
+  }
+}
+
+static int readNum() {
+  Read r;
+  return r.eval().num();
+}
+
+static int divideByZero() {
+  ArithOp::apply(DIV, 0, 0);
+  return 0;
+}
+
+// The displacement from rbp of a variable in the frame.
+static int frameOffset(int index) { return -16 - 8 * index; }
+
+jitContext::jitContext(Fun* f, jitCode& u)
+  :numLocals(0), pushes(0), fun(f), unit(u), blocks(0), returned(false)
+{
+  endLabel = newLabel();
+  emit({0x55});                         // push rbp
+  emit({0x48, 0x89, 0xE5});             // mov rbp, rsp
+  emit({0x53});                         // push rbx
+  emit({0x48, 0x81, 0xEC});             // sub rsp, N
+  frameSizeAt = code.size();
+  emit32(0);
+  if (fun) {
+    // The argument is the function's first variable.
+    jitVar arg = declare(fun->getVarSlot(), NUM_T);
+    emit({0x89, 0xBD});                 // mov [rbp+d], edi
+    emit32(frameOffset(arg.index));
+  }
+  else {
+    emit({0x48, 0x89, 0xFB});           // mov rbx, rdi
+  }
+}
+
+void jitContext::emit32(int n) {
+  for (int i = 0; i < 4; ++i) code.push_back((n >> (8 * i)) & 0xFF);
+}
+
+void jitContext::emit64(const void* p) {
+  unsigned long long n = (unsigned long long)p;
+  for (int i = 0; i < 8; ++i) code.push_back((n >> (8 * i)) & 0xFF);
+}
+
+void jitContext::emitJump(initializer_list<int> op, int label) {
+  emit(op);
+  fixups.push_back(make_pair((int)code.size(), label));
+  emit32(0);
+}
+
+// Calls an absolute address, aligning the stack if a value is pushed.
+void jitContext::callAddress(const void* fn) {
+  if (pushes % 2) emit({0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+  emit({0x48, 0xB8});                             // mov rax, fn
+  emit64(fn);
+  emit({0xFF, 0xD0});                             // call rax
+  if (pushes % 2) emit({0x48, 0x83, 0xC4, 0x08}); // add rsp, 8
+}
+
+bool jitContext::lookup(int slot, jitVar& var) {
+  if (jitVar* v = scope.lookup(slot)) {
+    var = *v;
+    return true;
+  }
+  // A function may only use its own variables.
+  if (fun) return false;
+  if (slot < (int)outerIndex.size() && outerIndex[slot] >= 0) {
+    var.index = outerIndex[slot];
+    var.type = unit.types[var.index];
+    var.outer = true;
+    return true;
+  }
+  // The first use in a loop of a variable from outside of it. It must
+  // have the same type every time the loop starts.
+  Value* v = state().lookup(slot);
+  if (!v || (v->getType() != NUM_T && v->getType() != BOOL_T)) return false;
+  if (slot >= (int)outerIndex.size()) outerIndex.resize(slot + 1, -1);
+  outerIndex[slot] = unit.slots.size();
+  unit.slots.push_back(slot);
+  unit.types.push_back(v->getType());
+  return lookup(slot, var);
+}
+
+jitVar jitContext::declare(int slot, VType type) {
+  jitVar var;
+  var.index = numLocals++;
+  var.type = type;
+  var.outer = false;
+  scope.bind(slot, var);
+  return var;
+}
+
+void jitContext::number(int n) {
+  emit({0xB8});                         // mov eax, n
+  emit32(n);
+}
+
+void jitContext::load(const jitVar& var) {
+  if (var.outer) {
+    emit({0x48, 0x8B, 0x93});           // mov rdx, [rbx+8*i]
+    emit32(8 * var.index);
+    emit({0x8B, 0x02});                 // mov eax, [rdx]
+  }
+  else {
+    emit({0x8B, 0x85});                 // mov eax, [rbp+d]
+    emit32(frameOffset(var.index));
+  }
+}
+
+// The type of an outer variable is already what is stored, so only
+// the number (or the boolean, with the rest of it zero) is written.
+void jitContext::store(const jitVar& var) {
+  if (var.outer) {
+    emit({0x48, 0x8B, 0x93});           // mov rdx, [rbx+8*i]
+    emit32(8 * var.index);
+    emit({0x89, 0x02});                 // mov [rdx], eax
+  }
+  else {
+    emit({0x89, 0x85});                 // mov [rbp+d], eax
+    emit32(frameOffset(var.index));
+  }
+}
+
+void jitContext::pushValue() {
+  emit({0x50});                         // push rax
+  ++pushes;
+}
+
+void jitContext::popOperands() {
+  emit({0x89, 0xC1});                   // mov ecx, eax
+  emit({0x58});                         // pop rax
+  --pushes;
+}
+
+void jitContext::add() { emit({0x01, 0xC8}); }        // add eax, ecx
+void jitContext::sub() { emit({0x29, 0xC8}); }        // sub eax, ecx
+void jitContext::mul() { emit({0x0F, 0xAF, 0xC1}); }  // imul eax, ecx
+
+// As in the interpreter, dividing by zero is an error, and dividing
+// by -1 negates (wrapping around) rather than letting idiv trap.
+void jitContext::div(bool remainder) {
+  int done = newLabel();
+  int ok = newLabel();
+  int divide = newLabel();
+  emit({0x85, 0xC9});                   // test ecx, ecx
+  emitJump({0x0F, 0x85}, ok);           // jnz ok
+  callAddress((void*)divideByZero);
+  jump(done);
+  place(ok);
+  emit({0x83, 0xF9, 0xFF});             // cmp ecx, -1
+  emitJump({0x0F, 0x85}, divide);       // jne divide
+  if (remainder) emit({0x31, 0xC0});    // xor eax, eax
+  else emit({0xF7, 0xD8});              // neg eax
+  jump(done);
+  place(divide);
+  emit({0x99});                         // cdq
+  emit({0xF7, 0xF9});                   // idiv ecx
+  if (remainder) emit({0x89, 0xD0});    // mov eax, edx
+  place(done);
+}
+
+void jitContext::compare(jitCond cond) {
+  static const int setcc[] = { 0x9C, 0x9F, 0x9E, 0x9D, 0x94, 0x95 };
+  emit({0x39, 0xC8});                   // cmp eax, ecx
+  emit({0x0F, setcc[cond], 0xC0});      // setcc al
+  emit({0x0F, 0xB6, 0xC0});             // movzx eax, al
+}
+
+void jitContext::neg() { emit({0xF7, 0xD8}); }           // neg eax
+void jitContext::notBool() { emit({0x83, 0xF0, 0x01}); } // xor eax, 1
+
+void jitContext::jump(int label) {
+  emitJump({0xE9}, label);              // jmp label
+}
+
+void jitContext::jumpIf(bool truth, int label) {
+  emit({0x85, 0xC0});                   // test eax, eax
+  emitJump({0x0F, truth ? 0x85 : 0x84}, label); // jnz/jz label
+}
+
+void jitContext::callSelf() {
+  emit({0x89, 0xC7});                   // mov edi, eax
+  if (pushes % 2) emit({0x48, 0x83, 0xEC, 0x08});
+  emit({0xE8});                         // call the start of this code
+  emit32(-(int)(code.size() + 4));
+  if (pushes % 2) emit({0x48, 0x83, 0xC4, 0x08});
+}
+
+void jitContext::callFun(const jitCode& callee) {
+  emit({0x89, 0xC7});                   // mov edi, eax
+  callAddress(callee.entry);
+}
+
+void jitContext::writeValue(VType type, bool newline) {
+  emit({0x89, 0xC7});                   // mov edi, eax
+  emit({0xBE});                         // mov esi, newline
+  emit32(newline);
+  callAddress(type == BOOL_T ? (void*)writeBool : (void*)writeNum);
+}
+
+void jitContext::writeStr(const char* s, bool newline) {
+  emit({0x48, 0xBF});                   // mov rdi, s
+  emit64(s);
+  emit({0xBE});                         // mov esi, newline
+  emit32(newline);
+  callAddress((void*)writeString);
+}
+
+void jitContext::read() {
+  callAddress((void*)readNum);
+}
+
+vector<unsigned char>& jitContext::finish() {
+  place(endLabel);
+  emit({0x48, 0x8B, 0x5D, 0xF8});       // mov rbx, [rbp-8]
+  emit({0xC9});                         // leave
+  emit({0xC3});                         // ret
+  for (auto& f : fixups) {
+    int rel = labels[f.second] - (f.first + 4);
+    for (int i = 0; i < 4; ++i) code[f.first + i] = (rel >> (8 * i)) & 0xFF;
+  }
+  int frame = 8 * numLocals;
+  if ((frame + 8) % 16) frame += 8;
+  for (int i = 0; i < 4; ++i) code[frameSizeAt + i] = (frame >> (8 * i)) & 0xFF;
+  return code;
+}
+
+// Copies the code into pages of its own, which are made executable
+// once it is there (and never writable again).
+bool Jit::install(jitCode& unit, jitContext& ctx, const string& name) {
+  vector<unsigned char>& code = ctx.finish();
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (code.size() + page - 1) / page * page;
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return false;
+  memcpy(p, code.data(), code.size());
+  if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(p, size);
+    return false;
+  }
+  unit.entry = p;
+  unit.size = size;
+  if (perfMap) addToPerfMap(p, code.size(), name);
+  return true;
+}
+
+Jit::~Jit() {
+  for (jitCode& unit : units) {
+    if (unit.entry) munmap(unit.entry, unit.size);
+  }
+}
+
+const jitCode* Jit::compile(Fun* f, jitState& st) {
+  if (!st.tried) {
+    st.tried = true;
+    units.emplace_back();
+    jitCode& unit = units.back();
+    unit.entry = NULL;
+    jitContext ctx(f, unit);
+    // Falling off the end of a function returns nothing, which can't
+    // be given back as a number; so the last statement must return.
+    if (f->getBody()->execJit(ctx) && ctx.returned
+        && install(unit, ctx, "spl:" + f->getName())) {
+      st.code = &unit;
+    }
+  }
+  return st.code;
+}
+
+bool Jit::runLoop(WhileStmt* loop, jitState& st) {
+  if (!st.tried) {
+    st.tried = true;
+    units.emplace_back();
+    jitCode& unit = units.back();
+    unit.entry = NULL;
+    jitContext ctx(NULL, unit);
+    ostringstream name;
+    name << "spl:while@" << loop->getLine();
+    if (loop->execJit(ctx) && install(unit, ctx, name.str())) st.code = &unit;
+  }
+  if (!st.code) return false;
+
+  const jitCode& code = *st.code;
+  splContext& spl = state();
+  vars.resize(code.slots.size());
+  for (unsigned i = 0; i < code.slots.size(); ++i) {
+    Value* v = spl.lookup(code.slots[i]);
+    if (!v || v->getType() != code.types[i]) return false;
+    vars[i] = v;
+  }
+  ((void (*)(Value**))code.entry)(vars.data());
+  return true;
+}
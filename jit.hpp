@@ -0,0 +1,172 @@
+/* C++ header file for the just-in-time compiler.
+ * The tree walker counts how often each function is called, and how many
+ * times each while loop goes around. Once one of them is hot, it is
+ * compiled to x86-64 machine code the same way codeGenContext compiles
+ * to assembly (every expression leaves its value in eax), and from then
+ * on that code is called directly.
+ *
+ * Only code that works on numbers and booleans is compiled: anything
+ * that would need the interpreter in the middle of it (a function that
+ * is not compiled itself, a global variable inside a function, a type
+ * that changes) makes the whole function or loop stay interpreted.
+ */
+
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <initializer_list>
+using namespace std;
+
+#include "value.hpp"
+#include "st.hpp"
+
+class Fun;
+class WhileStmt;
+
+// The machine code for one function or loop.
+struct jitCode {
+  void* entry;
+  size_t size;
+  // A loop works on variables from outside of it, which are found again
+  // each time it starts: their slots, and the types they must have.
+  vector<int> slots;
+  vector<VType> types;
+};
+
+// Kept in each function and loop node, to decide when to compile it.
+struct jitState {
+  int runs;            // calls or times around, until it is compiled
+  bool tried;          // once set, it is never compiled again
+  const jitCode* code; // NULL unless it was compiled successfully
+  jitState() :runs(0), tried(false), code(NULL) { }
+};
+
+// Conditions for jitContext::compare().
+enum jitCond {
+  JIT_LT, JIT_GT, JIT_LE, JIT_GE, JIT_EQ, JIT_NE
+};
+
+// A variable of the code being compiled.
+struct jitVar {
+  int index;  // in the machine stack frame, or in jitCode::slots
+  VType type; // NUM_T or BOOL_T
+  bool outer; // whether it is from outside a loop
+};
+
+/* The code for one function or loop, as it is being compiled.
+ * AST nodes add to it with their evalJit() and execJit() methods.
+ */
+class jitContext {
+  private:
+    vector<unsigned char> code;
+    vector<int> labels;               // where each label is, or -1
+    vector<pair<int, int> > fixups;   // (rel32 operand, label) to patch
+    int frameSizeAt;                  // operand of the prologue's sub rsp
+    int numLocals;
+    int pushes;                       // values pushed by pending expressions
+    int endLabel;
+    vector<int> outerIndex;           // by slot: index in unit.slots, or -1
+
+    void emit(initializer_list<int> bytes) {
+      for (int b : bytes) code.push_back(b);
+    }
+    void emit32(int n);
+    void emit64(const void* p);
+    void emitJump(initializer_list<int> op, int label);
+    void callAddress(const void* fn);
+
+  public:
+    Fun* fun;        // the function being compiled, or NULL for a loop
+    jitCode& unit;
+    SymbolTable<jitVar> scope; // variables made by the code, by slot
+    int blocks;      // depth of nested blocks
+    bool returned;   // whether the last statement compiled was a return
+
+    jitContext(Fun* f, jitCode& u);
+
+    // Finds a variable, or returns false if it can't be used here.
+    bool lookup(int slot, jitVar& var);
+    // Makes a new variable in the current block.
+    jitVar declare(int slot, VType type);
+
+    int newLabel() {
+      labels.push_back(-1);
+      return labels.size() - 1;
+    }
+    void place(int label) { labels[label] = code.size(); }
+
+    // The instructions. Values are in eax, with the left operand of a
+    // binary operation saved by pushValue() until popOperands().
+    void number(int n);             // mov eax, n
+    void load(const jitVar& var);
+    void store(const jitVar& var);
+    void pushValue();               // push rax
+    void popOperands();             // mov ecx, eax; pop rax
+    void add();
+    void sub();
+    void mul();
+    void div(bool remainder);       // reports dividing by zero
+    void compare(jitCond cond);     // eax = eax cond ecx
+    void neg();
+    void notBool();
+    void jump(int label);
+    void jumpIf(bool truth, int label); // on eax being true or false
+    void callSelf();                // eax = this function @ eax
+    void callFun(const jitCode& callee);
+    void writeValue(VType type, bool newline);
+    void writeStr(const char* s, bool newline);
+    void read();
+    void ret() { jump(endLabel); }  // return eax from the function
+
+    // Finishes the code, with the frame sized for the variables used.
+    vector<unsigned char>& finish();
+};
+
+/* Compiles hot functions and loops for one splContext, and holds their
+ * code for as long as it lasts.
+ */
+class Jit {
+  private:
+    deque<jitCode> units;
+    vector<Value*> vars; // for a loop that is starting
+
+    bool install(jitCode& unit, jitContext& ctx, const string& name);
+
+  public:
+    // Set unless the host can't run the code, or it was turned off.
+    static bool enabled;
+
+    // Set by --perf-map, to list the code in /tmp/perf-<pid>.map as it
+    // is installed, so that perf can name the functions and loops.
+    static bool perfMap;
+
+    // How many calls, or times around a loop, make it hot.
+    static const int HOT_CALLS = 100;
+    static const int HOT_LOOPS = 1000;
+
+    Jit() { }
+    ~Jit();
+
+    // Counts one more run, and says whether the code should be
+    // compiled (if it hasn't been) and called.
+    static bool hot(jitState& st, int threshold) {
+      return st.code || (!st.tried && enabled && ++st.runs >= threshold);
+    }
+
+    // Returns the function's code, compiling it first if that hasn't
+    // been tried yet. NULL means it can't be compiled.
+    const jitCode* compile(Fun* f, jitState& st);
+
+    // Runs the rest of a loop from the top, compiling it first if that
+    // hasn't been tried yet. Returns false if it has to be interpreted.
+    bool runLoop(WhileStmt* loop, jitState& st);
+
+  private:
+    Jit(const Jit&);
+    Jit& operator=(const Jit&);
+};
+
+#endif // JIT_HPP
@@ -1,11 +1,16 @@
 [BITS 32]
 
-global exit
-global write
-global writestr
-global writebool
-global writelf
-global read
+global exit:function (exit.end - exit)
+global write:function (write.end - write)
+global writestr:function (writestr.end - writestr)
+global writebool:function (writebool.end - writebool)
+global writelf:function (writelf.end - writelf)
+global read:function (read.end - read)
+global newarray:function (newarray.end - newarray)
+global writearray:function (writearray.end - writearray)
+global boundserror:function (boundserror.end - boundserror)
+global spl_prof_start
+global spl_prof_end
 
 section .bss
 
@@ -14,6 +19,16 @@ writebuffer_end: resb 1
 
 readbuffer: resb 1
 
+; Where the counters of an instrumented program are (see profdump), or
+; 0 if it isn't one. Set by its _start.
+spl_prof_start: resd 1
+spl_prof_end: resd 1
+
+profbuffer: resb 17
+
+; The end of the arrays made so far, or 0 before the first.
+heap_end: resd 1
+
 section .data
 
 true_str: db `true`
@@ -26,12 +41,103 @@ readerror: db `read error: invalid input\n\0`
 
 newline: db `\n`
 
+boundsmsg: db `ERROR: Array index out of bounds\n\0`
+negsizemsg: db `ERROR: Negative array size\n\0`
+toolargemsg: db `ERROR: Array too large\n\0`
+nomemorymsg: db `ERROR: Out of memory\n\0`
+brackets: db `[]`
+comma: db `, `
+
+profname: db `spl.profdata\0`
+hexdigits: db `0123456789abcdef`
+
 section .text
 
+; Ends the program with status 1, after a runtime error.
+exitfail:
+    mov ebx, 0x1
+    jmp exit.status
+
 exit:
+    xor ebx, ebx
+.status:
+    push ebx
+    cmp dword [spl_prof_start], 0
+    je .quit
+    call profdump
+.quit:
+    pop ebx
     mov eax, 0x1
-    mov ebx, 0x0
     int 0x80
+.end:
+
+; Appends the counters of every module in the program to spl.profdata.
+; Each module has a header: the address of the line that starts its
+; counts there, and how many counters follow, 64 bits each. They are
+; written out one to a line, as 16 hex digits.
+profdump:
+    mov eax, 0x5 ; open
+    lea ebx, [profname]
+    mov ecx, 0x441 ; O_WRONLY | O_CREAT | O_APPEND
+    mov edx, 420 ; 0644
+    int 0x80
+    test eax, eax
+    js .done
+    mov edi, eax
+    mov esi, [spl_prof_start]
+.module:
+    cmp esi, [spl_prof_end]
+    jae .close
+    mov ecx, [esi]
+    mov edx, ecx
+.len:
+    cmp byte [edx], 0
+    je .header
+    inc edx
+    jmp .len
+.header:
+    sub edx, ecx
+    mov eax, 0x4
+    mov ebx, edi
+    int 0x80
+    mov ebp, [esi+4]
+    add esi, 8
+.count:
+    test ebp, ebp
+    jz .module
+    mov eax, [esi+4]
+    lea ebx, [profbuffer]
+    call .hex
+    mov eax, [esi]
+    call .hex
+    mov byte [ebx], 0xa
+    mov eax, 0x4
+    mov ebx, edi
+    lea ecx, [profbuffer]
+    mov edx, 17
+    int 0x80
+    add esi, 8
+    dec ebp
+    jmp .count
+.close:
+    mov eax, 0x6
+    mov ebx, edi
+    int 0x80
+.done:
+    ret
+; Writes eax as 8 hex digits at ebx, and leaves ebx after them.
+.hex:
+    mov ecx, 8
+.digit:
+    rol eax, 4
+    mov edx, eax
+    and edx, 0xf
+    mov dl, [hexdigits+edx]
+    mov [ebx], dl
+    inc ebx
+    dec ecx
+    jnz .digit
+    ret
 
 writelf:
     mov eax, 0x4
@@ -40,6 +146,7 @@ writelf:
     mov edx, 0x1
     int 0x80
     ret
+.end:
 
 write:
     push eax
@@ -70,6 +177,7 @@ write:
     lea ecx, [writebuffer_end+ecx]
     int 0x80
     ret
+.end:
 
 writestr:
     mov edx, eax
@@ -85,6 +193,7 @@ writestr:
     mov eax, 0x4
     int 0x80
     ret
+.end:
 
 writebool:
     test eax, eax
@@ -100,6 +209,7 @@ writebool:
     mov ebx, 0x1
     int 0x80
     ret
+.end:
 
 read:
     xor eax, eax
@@ -157,4 +267,100 @@ read:
 .error:
     lea eax, [readerror]
     call writestr
-    call exit
+    call exitfail
+.end:
+
+; Makes an array of eax numbers, all 0, and returns its address. The
+; length is kept in the first word, before the numbers. Arrays go after
+; the program's data, which brk moves up for each, and are never freed.
+; They have at most 2^28 - 1 numbers, as in the interpreter.
+newarray:
+    test eax, eax
+    js .negative
+    cmp eax, 0x0fffffff
+    ja .toolarge
+    push edi
+    push eax
+    mov ebx, [heap_end]
+    test ebx, ebx
+    jnz .grow
+    mov eax, 0x2d ; brk(0) gives the current end
+    int 0x80
+    mov ebx, eax
+.grow:
+    mov edx, ebx
+    mov ecx, [esp]
+    lea ebx, [ebx+4*ecx+4]
+    cmp ebx, edx
+    jbe .nomemory
+    mov eax, 0x2d ; brk
+    int 0x80
+    cmp eax, ebx
+    jne .nomemory
+    mov [heap_end], ebx
+    pop ecx
+    mov edi, edx
+    mov eax, ecx
+    stosd
+    xor eax, eax
+    rep stosd
+    mov eax, edx
+    pop edi
+    ret
+.negative:
+    lea eax, [negsizemsg]
+    jmp .fail
+.toolarge:
+    lea eax, [toolargemsg]
+    jmp .fail
+.nomemory:
+    lea eax, [nomemorymsg]
+.fail:
+    call writestr
+    call exitfail
+.end:
+
+; Writes the array at eax, as [1, 2, 3].
+writearray:
+    push esi
+    push edi
+    mov esi, eax
+    xor edi, edi
+    lea ecx, [brackets]
+    call .bracket
+.loop:
+    cmp edi, [esi]
+    jae .done
+    test edi, edi
+    jz .element
+    mov eax, 0x4
+    mov ebx, 0x1
+    lea ecx, [comma]
+    mov edx, 0x2
+    int 0x80
+.element:
+    mov eax, [esi+4*edi+4]
+    call write
+    inc edi
+    jmp .loop
+.done:
+    lea ecx, [brackets+1]
+    call .bracket
+    pop edi
+    pop esi
+    ret
+; Writes the character at ecx.
+.bracket:
+    mov eax, 0x4
+    mov ebx, 0x1
+    mov edx, 0x1
+    int 0x80
+    ret
+.end:
+
+; Compiled code jumps here when an index is outside an array's bounds.
+boundserror:
+    lea eax, [boundsmsg]
+    call writestr
+    call exitfail
+.end:
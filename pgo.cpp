@@ -0,0 +1,25 @@
+/* Implementation of reading profiles for profile-guided optimization. */
+
+#include "pgo.hpp"
+#include <fstream>
+#include <cstdlib>
+
+// Each module's counts start with a line "module key count name", and
+// follow one to a line, as 16 hex digits.
+bool pgoProfile::load(const char* fname) {
+  ifstream in(fname);
+  if (!in) return false;
+  string word, key, name, hex;
+  unsigned long n;
+  while (in >> word >> key >> n) {
+    if (word != "module") return false;
+    getline(in, name);
+    vector<unsigned long long>& counts = modules[key];
+    counts.resize(n);
+    for (unsigned long i = 0; i < n; ++i) {
+      if (!(in >> hex)) return false;
+      counts[i] += strtoull(hex.c_str(), NULL, 16);
+    }
+  }
+  return in.eof();
+}
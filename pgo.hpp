@@ -0,0 +1,52 @@
+/* C++ header file for profile-guided optimization of compiled programs.
+ * A module compiled with --profile-generate counts how often each branch,
+ * loop, call and function runs, and libspl's exit appends the counts to
+ * spl.profdata. Compiling the same source again with --profile-use reads
+ * them back to decide how to lay out the code.
+ */
+
+#ifndef PGO_HPP
+#define PGO_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+using namespace std;
+
+// The file the instrumented program writes its counts to, in the
+// directory it is run from. See profdump in libspl.asm.
+#define PROFILE_DATA "spl.profdata"
+
+// A branch taken no more than 1/COLD_RATIO as often as the other way
+// is cold, and moved out of line.
+const unsigned COLD_RATIO = 16;
+
+// A loop that goes around at least UNROLL_TRIPS times each time it is
+// entered is unrolled once, if its body has no more than UNROLL_NODES
+// AST nodes.
+const unsigned UNROLL_TRIPS = 8;
+const unsigned UNROLL_NODES = 40;
+
+// Functions called at least this often go in .text.hot, together.
+// Those never called go in .text.unlikely.
+const unsigned long long HOT_FUNCTION_CALLS = 1000;
+
+// The counts from one or more runs of an instrumented program.
+class pgoProfile {
+  private:
+    // The counters of each module, by its source's key. Runs that were
+    // appended to the same file are added up.
+    map<string, vector<unsigned long long> > modules;
+
+  public:
+    // Reads the counts from fname. Returns false if it can't.
+    bool load(const char* fname);
+
+    // Returns the counters for a module, or NULL if it was not run.
+    const vector<unsigned long long>* find(const string& key) const {
+      auto i = modules.find(key);
+      return i == modules.end() ? NULL : &i->second;
+    }
+};
+
+#endif // PGO_HPP
@@ -0,0 +1,85 @@
+/* Implementation of the interpreter's profile report. */
+
+#include "ast.hpp"
+#include <cstdio>
+#include <algorithm>
+#include <map>
+
+// How many of the hottest lines the report shows.
+static const unsigned HOT_LINES = 20;
+
+// The statements on one source line, taken together.
+struct lineCount {
+  unsigned line;
+  unsigned long runs; // of the statement that ran most
+  unsigned long long self;
+  string labels;
+};
+
+void Profiler::enter(profileCount* c) {
+  ++c->depth;
+  running r = { c, 0, 0 };
+  stack.push_back(r);
+  stack.back().start = now();
+}
+
+void Profiler::leave() {
+  unsigned long long spent = now() - stack.back().start;
+  running r = stack.back();
+  stack.pop_back();
+  ++r.count->runs;
+  r.count->self += spent - r.inner;
+  if (--r.count->depth == 0) r.count->cycles += spent;
+  if (stack.empty()) total += spent;
+  else stack.back().inner += spent;
+}
+
+void Profiler::report(ostream& out, const char* fname) {
+  map<unsigned, lineCount> lines;
+  vector<pair<Fun*, const profileCount*> > funs;
+  for (auto& c : calls) funs.push_back(make_pair(c.first, &c.second));
+  for (auto& c : counts) {
+    lineCount& l = lines[c.first->getLine()];
+    l.line = c.first->getLine();
+    l.runs = max(l.runs, c.second.runs);
+    l.self += c.second.self;
+    ostringstream label;
+    c.first->describe(label);
+    if (l.labels.find(label.str()) == string::npos) {
+      if (!l.labels.empty()) l.labels += ' ';
+      l.labels += label.str();
+    }
+  }
+
+  vector<lineCount> hot;
+  for (auto& l : lines) hot.push_back(l.second);
+  sort(hot.begin(), hot.end(), [](const lineCount& a, const lineCount& b) {
+    return a.self > b.self;
+  });
+  if (hot.size() > HOT_LINES) hot.resize(HOT_LINES);
+  sort(funs.begin(), funs.end(),
+       [](const pair<Fun*, const profileCount*>& a,
+          const pair<Fun*, const profileCount*>& b) {
+    return a.second->cycles > b.second->cycles;
+  });
+
+  char buf[200];
+  out << "profile of " << fname << ": " << total << " cycles" << endl
+      << "   line   self       self cycles         runs  statements" << endl;
+  for (auto& l : hot) {
+    snprintf(buf, sizeof buf, "%7u %5.1f%% %17llu %12lu  ", l.line,
+             total ? 100.0 * l.self / total : 0.0, l.self, l.runs);
+    out << buf << l.labels << endl;
+  }
+  if (funs.empty()) return;
+  out << "   line  total   self            cycles        calls  function"
+      << endl;
+  for (auto& f : funs) {
+    snprintf(buf, sizeof buf, "%7u %5.1f%% %5.1f%% %17llu %12lu  ",
+             f.first->getLine(),
+             total ? 100.0 * f.second->cycles / total : 0.0,
+             total ? 100.0 * f.second->self / total : 0.0,
+             f.second->cycles, f.second->runs);
+    out << buf << f.first->getName() << endl;
+  }
+}
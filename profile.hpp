@@ -0,0 +1,102 @@
+/* C++ header file for the interpreter's profiler.
+ * With --profile, the tree walker counts the runs of each statement and
+ * the calls of each function, and the CPU cycles spent in them. When the
+ * script ends, it reports the hot spots by source line, and writes the
+ * AST as a DOT graph with each node colored by how hot it is.
+ */
+
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+using namespace std;
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+class AST;
+class Fun;
+
+// What was counted for one statement or function.
+struct profileCount {
+  unsigned long runs;
+  unsigned depth;            // runs in progress: more than one in recursion
+  unsigned long long cycles; // from start to finish, of the outermost runs
+  unsigned long long self;   // not in the statements and calls within it
+  profileCount() :runs(0), depth(0), cycles(0), self(0) { }
+};
+
+class Profiler {
+  private:
+    unordered_map<AST*, profileCount> counts; // by statement
+    unordered_map<Fun*, profileCount> calls;  // by function
+
+    // The statements and calls that have started and not finished.
+    struct running {
+      profileCount* count;
+      unsigned long long start;
+      unsigned long long inner; // cycles in the ones within it
+    };
+    vector<running> stack;
+
+    // The cycles spent in top-level statements, all together.
+    unsigned long long total;
+
+  public:
+    // Every top-level statement that was run, in order. They must be
+    // kept (not released from the arena) until the profile is written.
+    vector<AST*> trees;
+
+    Profiler() :total(0) { }
+
+    // A cycle counter: the time stamp counter where there is one.
+    static unsigned long long now() {
+#if defined(__i386__) || defined(__x86_64__)
+      return __rdtsc();
+#else
+      return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    // Starts a run of a statement or call of a function.
+    void enter(AST* node) { enter(&counts[node]); }
+    void enter(Fun* f) { enter(&calls[f]); }
+    void enter(profileCount* c);
+
+    // Finishes the one started most recently.
+    void leave();
+
+    // Returns what was counted for the node, or NULL if it never ran.
+    const profileCount* find(AST* node) const {
+      auto i = counts.find(node);
+      return i == counts.end() ? NULL : &i->second;
+    }
+
+    // How much of all the time (from 0 to 1) was spent in the node
+    // itself, and its expressions.
+    double heat(const profileCount& c) const {
+      return total ? (double)c.self / total : 0;
+    }
+
+    // Writes the hot spots: the statements and functions that took
+    // the most cycles of their own, with their source lines.
+    void report(ostream& out, const char* fname);
+};
+
+// Profiles a statement or function call for as long as it is in scope.
+class profileTimer {
+  private:
+    Profiler* prof;
+  public:
+    template <class T>
+    profileTimer(Profiler* p, T* node) :prof(p) {
+      if (prof) prof->enter(node);
+    }
+    ~profileTimer() { if (prof) prof->leave(); }
+};
+
+#endif // PROFILE_HPP
@@ -0,0 +1,254 @@
+/* Implementation of the compile server.
+ * The main thread accepts connections and queues them; a fixed pool of
+ * workers takes them in turn. Each worker handles a request in a child
+ * process forked for it, so a script that crashes it (by recursing
+ * without end, say) takes down only its own request. Requests share
+ * nothing but the cache.
+ */
+
+#include "server.hpp"
+#include "compile.hpp"
+#include "ast.hpp"
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Set by SIGINT or SIGTERM, to stop accepting connections.
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int) { stopping = 1; }
+
+// The server's socket, and its process (rather than a request's).
+static char socketPath[sizeof(((sockaddr_un*)0)->sun_path)];
+static pid_t serverPid;
+
+// Removes the socket if the server itself crashes, so that clients
+// don't try to connect to it, then crashes as it would have.
+static void crash(int sig) {
+  if (getpid() == serverPid) unlink(socketPath);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static bool readFile(const string& fname, string& out) {
+  ifstream in(fname.c_str(), ios::binary);
+  if (!in) return false;
+  ostringstream s;
+  s << in.rdbuf();
+  out = s.str();
+  return true;
+}
+
+static bool writeFile(const string& fname, const string& text) {
+  ofstream out(fname.c_str(), ios::binary);
+  out << text;
+  return bool(out);
+}
+
+// Compiles one module, as compileFile does, but from and to memory.
+// The cache and nasm work on files, so these get a directory of their
+// own while the request lasts.
+static void compileRequest(message& req, message& reply) {
+  const string& name = req["name"];
+  const string& source = req["source"];
+  bool allowImports = req.count("imports");
+  bool assemble = req.count("assemble");
+  bool debug = req.count("debug");
+  int status = 0;
+  reply["asmfile"] = outputName(name, ".asm");
+  if (assemble) reply["objfile"] = outputName(name, ".o");
+
+  string dir, asmfile, objfile;
+  if (cache || assemble) {
+    char tmp[] = "/tmp/spl-server.XXXXXX";
+    if (!mkdtemp(tmp)) {
+      reply["status"] = "2";
+      reply["diagnostics"] = "Could not make a directory to compile in\n";
+      return;
+    }
+    dir = tmp;
+    asmfile = dir + "/module.asm";
+    objfile = dir + "/module.o";
+  }
+
+  string key;
+  bool hit = false;
+  if (cache) {
+    string options = allowImports ? "imports" : "";
+    // The debug info names the source file, so its name is part of the key.
+    if (debug) options += " -g " + name;
+    key = compileCache::key(source, options);
+    hit = cache->fetch(key, ".asm", asmfile)
+       && (!assemble || cache->fetch(key, ".o", objfile));
+    cache->record(hit);
+  }
+  if (hit) {
+    readFile(asmfile, reply["asm"]);
+    if (assemble) readFile(objfile, reply["object"]);
+  }
+  else {
+    string code;
+    if (!compileSource(source, code, reply["diagnostics"], allowImports,
+                       name.c_str(), debug)) {
+      status = 5;
+    }
+    reply["asm"] = code;
+    if (!dir.empty() && !writeFile(asmfile, code)) status = 5;
+    if (status == 0 && assemble) {
+      vector<const char*> nasm = {"nasm", "-felf", asmfile.c_str(),
+                                  "-o", objfile.c_str()};
+      if (debug) nasm.insert(nasm.end(), {"-g", "-F", "dwarf"});
+      nasm.push_back(NULL);
+      if (runCommand(nasm.data()) != 0
+          || !readFile(objfile, reply["object"])) {
+        status = 5;
+      }
+    }
+    if (status == 0 && cache) {
+      cache->store(key, ".asm", asmfile);
+      if (assemble) cache->store(key, ".o", objfile);
+    }
+  }
+  reply["status"] = to_string(status);
+
+  if (!dir.empty()) {
+    remove(asmfile.c_str());
+    remove(objfile.c_str());
+    rmdir(dir.c_str());
+  }
+}
+
+static void respond(message& req, message& reply) {
+  if (req["op"] == "compile") compileRequest(req, reply);
+  else if (req["op"] == "run") {
+    VM vm;
+    int status = interpretSource(req["source"], req["input"], reply["output"],
+                                 reply["diagnostics"],
+                                 req.count("vm") ? &vm : NULL);
+    reply["status"] = to_string(status);
+  }
+  else {
+    reply["status"] = "2";
+    reply["diagnostics"] = "Unknown request \"" + req["op"] + "\"\n";
+  }
+}
+
+// Answers a request from a child process. If it dies, the reply says so.
+static void handle(int fd) {
+  message req, reply;
+  if (!readMessage(fd, req)) return;
+  pid_t pid = fork();
+  if (pid == 0) {
+    respond(req, reply);
+    sendMessage(fd, reply);
+    _exit(0);
+  }
+  int status = 0;
+  if (pid > 0) {
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+    if (WIFEXITED(status)) return;
+  }
+  if (pid < 0) {
+    reply["status"] = "2";
+    reply["diagnostics"] = "The server could not start a process\n";
+  }
+  else {
+    int sig = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    reply["status"] = to_string(128 + sig);
+    reply["diagnostics"] = string("The request was killed by ")
+                         + strsignal(sig) + "\n";
+  }
+  sendMessage(fd, reply);
+}
+
+int serve(const string& path, int workers) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) {
+    cerr << "Socket path \"" << path << "\" is too long" << endl;
+    return 2;
+  }
+  strcpy(addr.sun_path, path.c_str());
+  strcpy(socketPath, path.c_str());
+  serverPid = getpid();
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) return 2;
+  // A socket left by a server that is gone can be replaced, but not
+  // one that is still being served.
+  if (connect(listener, (sockaddr*)&addr, sizeof addr) == 0) {
+    cerr << "A server is already listening on " << path << endl;
+    close(listener);
+    return 2;
+  }
+  close(listener);
+  unlink(path.c_str());
+  // Neither it nor the connections are left open in nasm.
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(077); // only this user may connect
+  bool bound = listener >= 0
+            && bind(listener, (sockaddr*)&addr, sizeof addr) == 0;
+  umask(mask);
+  if (!bound || listen(listener, SOMAXCONN) != 0) {
+    cerr << "Could not listen on " << path << endl;
+    return 2;
+  }
+
+  // Interrupting accept lets the server finish what it has and exit.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN); // a client that gave up is not our problem
+  for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+    signal(sig, crash);
+  }
+
+  deque<int> pending;
+  mutex lock;
+  condition_variable ready;
+  bool done = false;
+  vector<thread> pool;
+  for (int i = 0; i < workers; ++i) {
+    pool.push_back(thread([&]() {
+      while (true) {
+        int fd;
+        {
+          unique_lock<mutex> guard(lock);
+          ready.wait(guard, [&]() { return done || !pending.empty(); });
+          if (pending.empty()) return;
+          fd = pending.front();
+          pending.pop_front();
+        }
+        handle(fd);
+        close(fd);
+      }
+    }));
+  }
+
+  while (!stopping) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) continue;
+    lock_guard<mutex> guard(lock);
+    pending.push_back(fd);
+    ready.notify_one();
+  }
+  {
+    lock_guard<mutex> guard(lock);
+    done = true;
+  }
+  ready.notify_all();
+  for (auto& w : pool) w.join();
+  close(listener);
+  unlink(path.c_str());
+  return 0;
+}
@@ -0,0 +1,106 @@
+/* C++ header file for the compile server and its client.
+ * `spl --server` keeps one warm process with a pool of worker threads,
+ * listening on a Unix socket. spl-client takes the same arguments as spl,
+ * and sends each file to the server instead of starting a compiler for
+ * it. Each request is compiled or run in a process of its own.
+ *
+ * A request or reply is a set of named fields, each written as a line
+ * "name length" followed by that many bytes, and the connection is shut
+ * down after it. The client sends one request per connection:
+ *   op        "compile" or "run"
+ *   name      the source file's name, as the client was given it
+ *   source    its text
+ *   imports   (compile) if present, undefined functions become externs
+ *   assemble  (compile) if present, an object file is made as well
+ *   debug     (compile) if present, as for -g
+ *   vm        (run) if present, run on the bytecode VM
+ *   input     (run) what the script reads
+ * and the reply has:
+ *   status       the exit code spl itself would give
+ *   diagnostics  the error messages
+ *   asmfile, asm, objfile, object  (compile) the files to write
+ *   output       (run) what the script wrote
+ */
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <string>
+#include <map>
+#include <sstream>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+using namespace std;
+
+typedef map<string, string> message;
+
+// The socket the server listens on: $SPL_SERVER, or one per user in /tmp.
+inline string serverSocket() {
+  const char* env = getenv("SPL_SERVER");
+  if (env && *env) return env;
+  ostringstream path;
+  path << "/tmp/spl-" << getuid() << ".sock";
+  return path.str();
+}
+
+// Writes all of len bytes, or returns false.
+inline bool writeAll(int fd, const char* s, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, s, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    s += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Reads from fd until end of file.
+inline bool readAll(int fd, string& out) {
+  char buf[65536];
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof buf);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+    if (n == 0) return true;
+    out.append(buf, n);
+  }
+}
+
+inline bool sendMessage(int fd, const message& m) {
+  string out;
+  for (auto& f : m) {
+    ostringstream head;
+    head << f.first << ' ' << f.second.size() << '\n';
+    out += head.str();
+    out += f.second;
+  }
+  return writeAll(fd, out.data(), out.size()) && shutdown(fd, SHUT_WR) == 0;
+}
+
+// Reads a whole message. Returns false if it is cut short.
+inline bool readMessage(int fd, message& m) {
+  string in;
+  if (!readAll(fd, in)) return false;
+  size_t pos = 0;
+  while (pos < in.size()) {
+    size_t space = in.find(' ', pos);
+    size_t eol = in.find('\n', pos);
+    if (space == string::npos || eol == string::npos || space > eol) {
+      return false;
+    }
+    size_t len = strtoul(in.c_str() + space + 1, NULL, 10);
+    if (in.size() - (eol + 1) < len) return false;
+    m[in.substr(pos, space - pos)] = in.substr(eol + 1, len);
+    pos = eol + 1 + len;
+  }
+  return true;
+}
+
+// Serves requests on the socket at path with a pool of workers, until
+// it is interrupted. Returns the exit code.
+int serve(const string& path, int workers);
+
+#endif // SERVER_HPP
@@ -6,53 +6,93 @@
 #ifndef ST_HPP
 #define ST_HPP
 
-#include <iostream>
-#include <map>
-#include <string>
+#include <vector>
 using namespace std;
 
-#include "value.hpp"
-
-// Global variable to indicate if an error has occurred.
-extern bool error;
-
-// Declare the output streams to use everywhere
-extern colorout resout;
-extern colorout errout;
-
-/* This class represents a simple global symbol table.
- * Later we will extend it to support dynamic scoping.
+/* This class represents a lexically scoped symbol table, mapping keys to
+ * values of type T. The keys are small integers: interned symbols, or
+ * the interpreter's variable slots.
+ *
+ * All bindings are kept in one vector in the order they were made, and
+ * each frame (a block, or a function call) is just the position where it
+ * starts. For every key, the position of its innermost binding is kept in
+ * a table indexed by the key, and each binding remembers the one it hides.
+ * So a lookup is two array accesses, and popping a frame restores exactly
+ * the bindings its own ones hid. Nothing is allocated per lookup.
  */
+template <class T>
 class SymbolTable {
   private:
-    // The actual map. It is declared private, so it can only
-    // be accessed via the public methods below.
-    map<string,Value> bindings;
+    struct binding {
+      unsigned key;
+      int hidden; // position of the binding this one hides, or -1
+      T val;
+    };
+    vector<binding> bindings;
+    vector<int> innermost; // by key: position of its binding, or -1
+    vector<size_t> frames; // where each frame starts in bindings
+
+    int find(unsigned key) const {
+      return key < innermost.size() ? innermost[key] : -1;
+    }
 
   public:
-    // Creates a new, empty symbol table
+    // Creates a new, empty symbol table, with just the global frame.
     SymbolTable() { }
 
-    // Returns the Value bound to the given name.
-    Value lookup(string name) {
-      if (bindings.count(name) > 0) return bindings[name];
-      if (!error) {
-        error = true;
-        errout << "ERROR: No binding for variable " << name << endl;
+    // Starts a new innermost frame.
+    void push() { frames.push_back(bindings.size()); }
+
+    // Ends the innermost frame, removing its bindings.
+    void pop() {
+      size_t start = frames.back();
+      frames.pop_back();
+      while (bindings.size() > start) {
+        innermost[bindings.back().key] = bindings.back().hidden;
+        bindings.pop_back();
+      }
+    }
+
+    // Removes every binding and frame. The memory is kept for reuse.
+    void clear() {
+      frames.clear();
+      while (!bindings.empty()) {
+        innermost[bindings.back().key] = bindings.back().hidden;
+        bindings.pop_back();
       }
-      return Value();
     }
 
-    // Creates a new name-value binding
-    void bind(string name, Value val = Value()) {
-      bindings[name] = val;
-      // YOU HAVE TO WRITE THE ERROR CHECKING!
+    // Returns the innermost value bound to the key, or NULL if none is.
+    T* lookup(unsigned key) {
+      int i = find(key);
+      return i < 0 ? NULL : &bindings[i].val;
+    }
+
+    // Returns true if no frame has been started, so that a new binding
+    // would be global.
+    bool global() const { return frames.empty(); }
+
+    // Returns true if the key is bound in the innermost frame itself.
+    bool boundHere(unsigned key) const {
+      int i = find(key);
+      return i >= 0 && (frames.empty() || i >= (int)frames.back());
+    }
+
+    // Creates a new binding in the innermost frame, hiding any outer one.
+    void bind(unsigned key, const T& val) {
+      if (key >= innermost.size()) innermost.resize(key + 1, -1);
+      binding b = { key, innermost[key], val };
+      innermost[key] = bindings.size();
+      bindings.push_back(b);
     }
 
-    // Re-defines the value bound to the given name.
-    void rebind(string name, Value val) {
-      bindings[name] = val;
-      // YOU HAVE TO WRITE THE ERROR CHECKING!
+    // Re-defines the value in the innermost binding of the key.
+    // Returns false if it is not bound at all.
+    bool rebind(unsigned key, const T& val) {
+      T* v = lookup(key);
+      if (!v) return false;
+      *v = val;
+      return true;
     }
 };
 
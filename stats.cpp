@@ -0,0 +1,115 @@
+/* Implementation of the compiler statistics report. */
+
+#include "stats.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <cxxabi.h>
+#include <sys/resource.h>
+
+static const char* phaseNames[NUM_PHASES] = {
+  "lexing", "parsing", "typing", "codegen", "writing", "emitting",
+  "assembling", "other"
+};
+
+// The name of a class, as it is written in the source.
+static string className(const type_index& t) {
+  int status;
+  char* name = abi::__cxa_demangle(t.name(), NULL, NULL, &status);
+  if (status != 0) return t.name();
+  string s = name;
+  free(name);
+  return s;
+}
+
+// Writes s as a JSON string.
+static void writeJSON(ostream& out, const string& s) {
+  out << '"';
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') out << '\\' << c;
+    else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof esc, "\\u%04x", c);
+      out << esc;
+    }
+    else out << c;
+  }
+  out << '"';
+}
+
+void compileStats::write(ostream& out, const char* fname, statsFormat format) {
+  enter(phase);
+  double total = chrono::duration<double>(since - started).count();
+  unsigned long numNodes = 0;
+  map<string, unsigned long> byName;
+  for (auto& n : nodes) {
+    numNodes += n.second;
+    byName[className(n.first)] += n.second;
+  }
+  unsigned long instructions = topInstructions;
+  for (auto& f : functions) instructions += f.second;
+  // The whole process's peak, which includes any other compilations
+  // running beside this one. Linux gives it in kilobytes.
+  struct rusage usage;
+  long peakRSS = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+
+  if (format == JSON_STATS) {
+    out << fixed << setprecision(6) << "{\"file\": ";
+    writeJSON(out, fname);
+    out << ", \"seconds\": {\"total\": " << total;
+    for (int i = 0; i < NUM_PHASES; ++i) {
+      out << ", \"" << phaseNames[i] << "\": " << seconds[i];
+    }
+    out << "}, \"tokens\": " << tokens
+        << ", \"nodes\": {\"total\": " << numNodes;
+    for (auto& n : byName) {
+      out << ", ";
+      writeJSON(out, n.first);
+      out << ": " << n.second;
+    }
+    out << "}, \"instructions\": {\"total\": " << instructions
+        << ", \"top\": " << topInstructions << ", \"functions\": {";
+    for (unsigned i = 0; i < functions.size(); ++i) {
+      if (i) out << ", ";
+      writeJSON(out, functions[i].first);
+      out << ": " << functions[i].second;
+    }
+    out << "}}, \"functions\": " << functions.size()
+        << ", \"literals\": " << literals
+        << ", \"labels\": " << labels
+        << ", \"arena\": {\"allocations\": " << arenaAllocations
+        << ", \"bytes\": " << arenaBytes
+        << ", \"peak\": " << arenaPeak << "}"
+        << ", \"peak_rss_kb\": " << peakRSS << "}" << endl;
+    return;
+  }
+
+  char line[100];
+  snprintf(line, sizeof line, "%.6f s", total);
+  out << fname << ": " << line << endl;
+  for (int i = 0; i < NUM_PHASES; ++i) {
+    snprintf(line, sizeof line, "  %-12s %9.6f s %5.1f%%", phaseNames[i],
+             seconds[i], total > 0 ? 100 * seconds[i] / total : 0.0);
+    out << line << endl;
+  }
+  out << "  tokens:       " << tokens << endl
+      << "  AST nodes:    " << numNodes << endl;
+  for (auto& n : byName) {
+    snprintf(line, sizeof line, "    %-12s %10lu", n.first.c_str(),
+             n.second);
+    out << line << endl;
+  }
+  out << "  functions:    " << functions.size() << endl
+      << "  instructions: " << instructions << endl;
+  snprintf(line, sizeof line, "    %-12s %10lu", "(top level)", topInstructions);
+  out << line << endl;
+  for (auto& f : functions) {
+    snprintf(line, sizeof line, "    %-12s %10lu", f.first.c_str(), f.second);
+    out << line << endl;
+  }
+  out << "  literals:     " << literals << endl
+      << "  labels:       " << labels << endl
+      << "  arena:        " << arenaAllocations << " allocations, "
+      << arenaBytes << " bytes, peak " << arenaPeak << " bytes held" << endl
+      << "  peak RSS:     " << peakRSS << " KB" << endl;
+}
@@ -0,0 +1,90 @@
+/* C++ header file for compiler statistics.
+ * With --stats, each compilation times its phases and counts what it
+ * builds and generates, and reports all of it when it is done, to show
+ * which sources and which phases the time and memory go to.
+ */
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <typeindex>
+using namespace std;
+
+// The phases of a compilation. Time outside of all the others (opening
+// the file, the cache) counts as OTHER.
+enum Phase {
+  LEXING,     // the scanner
+  PARSING,    // the parser, less the scanner it calls
+  TYPING,     // type inference
+  CODEGEN,    // generating instructions for each statement
+  WRITING,    // writing them to the .asm body as each statement ends
+  EMITTING,   // generateCode: the header, and copying the body out
+  ASSEMBLING, // running nasm, with -c or -o
+  OTHER,
+  NUM_PHASES
+};
+
+// How to report the statistics, if at all.
+enum statsFormat { NO_STATS, TEXT_STATS, JSON_STATS };
+
+struct compileStats {
+  typedef chrono::steady_clock clock;
+
+  // The time is charged to one phase at a time: whichever was entered
+  // most recently, so a phase that runs inside another (the scanner,
+  // inside the parser) is not counted twice.
+  double seconds[NUM_PHASES];
+  Phase phase;
+  clock::time_point started, since;
+
+  unsigned long tokens;
+  map<type_index, unsigned long> nodes;          // AST nodes, by class
+  vector<pair<string, unsigned long> > functions; // instructions in each
+  unsigned long topInstructions;                 // outside of functions
+  unsigned long literals;
+  unsigned long labels;
+
+  // The front end's arena, as it was when the compilation finished.
+  size_t arenaAllocations, arenaBytes, arenaPeak;
+
+  compileStats()
+    :phase(OTHER), started(clock::now()), since(started), tokens(0),
+     topInstructions(0), literals(0), labels(0),
+     arenaAllocations(0), arenaBytes(0), arenaPeak(0) {
+    for (int i = 0; i < NUM_PHASES; ++i) seconds[i] = 0;
+  }
+
+  // Charges the time since the last switch to the current phase, and
+  // makes p current instead. Returns the phase that was current.
+  Phase enter(Phase p) {
+    clock::time_point now = clock::now();
+    seconds[phase] += chrono::duration<double>(now - since).count();
+    since = now;
+    Phase prev = phase;
+    phase = p;
+    return prev;
+  }
+
+  // Writes everything out for the named source file, as text or as
+  // one line of JSON.
+  void write(ostream& out, const char* fname, statsFormat format);
+};
+
+// Times a phase for as long as it is in scope, if there are stats.
+class phaseTimer {
+  private:
+    compileStats* stats;
+    Phase prev;
+  public:
+    phaseTimer(compileStats* s, Phase p) :stats(s), prev(OTHER) {
+      if (stats) prev = stats->enter(p);
+    }
+    ~phaseTimer() { if (stats) stats->enter(prev); }
+};
+
+#endif // STATS_HPP
@@ -17,25 +17,31 @@ class Lambda;
 // This gives the type of what's stored in the Value object.
 // NONE_T means nothing has been set yet.
 enum VType {
-  NUM_T, BOOL_T, FUN_T, NONE_T
+  NUM_T, BOOL_T, FUN_T, ARR_T, NONE_T
 };
 
 class Value {
   private:
-    // The value is either an int, a bool, or a pointer to a Lambda.
+    // The value is either an int, a bool, a pointer to a Lambda, or
+    // an array: its length, followed by that many ints, as compiled
+    // code lays them out too.
     union {
       int num;
       bool tf;
       Lambda* func;
+      int* arr;
     } val;
 
     VType type;
 
   public:
-    Value() :type(NONE_T) { }
+    Value() :type(NONE_T) { val.num = 0; }
     Value(int n) :type(NUM_T) { val.num = n; }
-    Value(bool b) :type(BOOL_T) { val.tf = b; }
+    // The whole int is set, so that num() of a boolean is 0 or 1,
+    // just as it is in compiled code.
+    Value(bool b) :type(BOOL_T) { val.num = 0; val.tf = b; }
     Value(Lambda* ptr) :type(FUN_T) { val.func = ptr; }
+    Value(int* a) :type(ARR_T) { val.arr = a; }
 
     VType getType() { return type; }
     void setType(VType t) { type = t; }
@@ -44,20 +50,26 @@ class Value {
 
     bool tf() { return val.tf; }
 
+    // The truth of a condition: nonzero numbers, true and arrays.
     bool coerceBool() {
-      bool branch;
+      bool branch = false;
       if (getType() == NUM_T) {
         branch = (num() != 0);
       }
       else if (getType() == BOOL_T) {
         branch = tf();
       }
+      else if (getType() == ARR_T) {
+        branch = true;
+      }
       return branch;
     }
 
 
     Lambda* func() { return val.func; }
 
+    int* arr() { return val.arr; }
+
     /* Writes a representation of this Value object to the
      * named output stream, according to the stored type.
      */
@@ -66,7 +78,15 @@ class Value {
         case NUM_T: out << val.num; break;
         case BOOL_T: out << (val.tf ? "true" : "false"); break;
         case FUN_T: out << "lambda expression"; break;
-        case NONE_T: cout << "UNSET"; break;
+        case ARR_T:
+          out << '[';
+          for (int i = 1; i <= val.arr[0]; ++i) {
+            if (i > 1) out << ", ";
+            out << val.arr[i];
+          }
+          out << ']';
+          break;
+        case NONE_T: out << "UNSET"; break;
       }
     }
 
@@ -86,6 +106,7 @@ class Value {
         case NUM_T: return val.num == other.val.num;
         case BOOL_T: return val.tf == other.val.tf;
         case FUN_T: return val.func == other.val.func;
+        case ARR_T: return val.arr == other.val.arr;
         case NONE_T: return true;
       }
     }
@@ -0,0 +1,274 @@
+/* Implementation of the bytecode virtual machine.
+ * The main loop uses computed gotos (a GCC and clang extension): each
+ * instruction jumps straight to the next one's handler, which is much
+ * easier on the branch predictor than one shared switch.
+ */
+
+#include "vm.hpp"
+#include "ast.hpp"
+
+// How many values each instruction leaves on the stack, less how
+// many it takes off. Jumps count as falling through.
+const int stackEffect[NUMOPS] = {
+  0,              // HALT
+  1, 1, 1, -1, -1, // PUSH PUSHB LOAD STORE BINDVAR
+  0, 0, 0, 0,     // NEWVAR SETVAR ENTER LEAVE
+  -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1,
+  0, 0,           // NEGOP NOTOP
+  0, -1, -1,      // TRUTH ANDJ ORJ
+  0, -1,          // JUMP JFALSE
+  1, -1, 0,       // READOP WRITEOP WRITESTR
+  0, 1,           // EXECNODE EVALNODE
+  -1, 1, 0, -1,   // POP UNSET CALLOP RETOP
+  0, -1, -3, 0    // NEWARR INDEX SETELEM LENOP
+};
+
+const int stackUse[NUMOPS] = {
+  0,              // HALT
+  0, 0, 0, 1, 1,  // PUSH PUSHB LOAD STORE BINDVAR
+  0, 0, 0, 0,     // NEWVAR SETVAR ENTER LEAVE
+  2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2,
+  1, 1,           // NEGOP NOTOP
+  1, 1, 1,        // TRUTH ANDJ ORJ
+  0, 1,           // JUMP JFALSE
+  0, 1, 0,        // READOP WRITEOP WRITESTR
+  0, 0,           // EXECNODE EVALNODE
+  1, 0, 1, 1,     // POP UNSET CALLOP RETOP
+  1, 2, 3, 1      // NEWARR INDEX SETELEM LENOP
+};
+
+const int numOperands[NUMOPS] = {
+  0,              // HALT
+  1, 1, 1, 1, 1,  // PUSH PUSHB LOAD STORE BINDVAR
+  2, 2, 0, 0,     // NEWVAR SETVAR ENTER LEAVE
+  0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0,
+  0, 0,           // NEGOP NOTOP
+  0, 1, 1,        // TRUTH ANDJ ORJ
+  1, 1,           // JUMP JFALSE
+  0, 1, 2,        // READOP WRITEOP WRITESTR
+  1, 1,           // EXECNODE EVALNODE
+  0, 0, 1, 0,     // POP UNSET CALLOP RETOP
+  0, 0, 0, 0      // NEWARR INDEX SETELEM LENOP
+};
+
+void Bytecode::emit(Opcode op) {
+  code.push_back(op);
+  depth += stackEffect[op];
+  if (depth > maxDepth) maxDepth = depth;
+}
+
+void VM::run(Bytecode& bc) {
+  static void* const handlers[NUMOPS] = {
+    &&halt, &&push, &&pushb, &&load, &&store, &&bindvar,
+    &&newvar, &&setvar, &&enter, &&leave,
+    &&add, &&sub, &&mul, &&div, &&mod,
+    &&lt, &&gt, &&le, &&ge, &&eq, &&ne,
+    &&neg, &&notop, &&truth, &&andj, &&orj, &&jump, &&jfalse,
+    &&read, &&write, &&writestr, &&execnode, &&evalnode,
+    &&pop, &&unset, &&call, &&ret,
+    &&newarr, &&index, &&setelem, &&length
+  };
+  if (stack.size() < bc.maxDepth + 1) stack.resize(bc.maxDepth + 1);
+  splContext& spl = state();
+  Bytecode* cur = &bc;
+  const int* code = bc.start();
+  const int* pc = code;
+  Value* sp = stack.data(); // one past the top
+
+  #define NEXT goto *handlers[*pc++]
+  #define BINARY(expr) { int r = (--sp)->num(); int l = sp[-1].num(); \
+                         sp[-1] = Value(expr); NEXT; }
+
+  NEXT;
+
+push:
+  *sp++ = Value(*pc++);
+  NEXT;
+pushb:
+  *sp++ = Value(*pc++ != 0);
+  NEXT;
+load:
+  if (Value* v = spl.lookup(*pc++)) *sp++ = *v;
+  else {
+    spl.error = true;
+    errout << "ERROR: Can't reference, not yet bound!\n";
+    *sp++ = Value(0);
+  }
+  NEXT;
+store:
+  *spl.lookup(*pc++) = *--sp;
+  NEXT;
+bindvar:
+  spl.scope().bind(*pc++, *--sp);
+  NEXT;
+newvar:
+  if (spl.scope().boundHere(pc[0])) {
+    state().error = true;
+    errout << "ERROR: Variable already bound\n";
+    pc = code + pc[1];
+  }
+  else pc += 2;
+  NEXT;
+setvar:
+  if (!spl.lookup(pc[0])) {
+    state().error = true;
+    errout << "ERROR: Can't rebind; not yet bound!\n";
+    pc = code + pc[1];
+  }
+  else pc += 2;
+  NEXT;
+
+enter:
+  spl.scope().push();
+  NEXT;
+leave:
+  spl.scope().pop();
+  NEXT;
+
+add: BINARY(l + r)
+sub: BINARY(l - r)
+mul: BINARY(l * r)
+// apply() reports a zero divisor, and takes care of INT_MIN / -1.
+div: {
+  int r = (--sp)->num();
+  int l = sp[-1].num();
+  sp[-1] = r != 0 && r != -1 ? Value(l / r) : ArithOp::apply(DIV, l, r);
+  NEXT;
+}
+mod: {
+  int r = (--sp)->num();
+  int l = sp[-1].num();
+  sp[-1] = r != 0 && r != -1 ? Value(l % r) : ArithOp::apply(MOD, l, r);
+  NEXT;
+}
+lt: BINARY(l < r)
+gt: BINARY(l > r)
+le: BINARY(l <= r)
+ge: BINARY(l >= r)
+eq: BINARY(l == r)
+ne: BINARY(l != r)
+neg:
+  sp[-1] = Value(-sp[-1].num());
+  NEXT;
+notop:
+  sp[-1] = Value(!sp[-1].coerceBool());
+  NEXT;
+truth:
+  sp[-1] = Value(sp[-1].coerceBool());
+  NEXT;
+andj:
+  if (!sp[-1].coerceBool()) {
+    sp[-1] = Value(false);
+    pc = code + *pc;
+  }
+  else { --sp; ++pc; }
+  NEXT;
+orj:
+  if (sp[-1].coerceBool()) {
+    sp[-1] = Value(true);
+    pc = code + *pc;
+  }
+  else { --sp; ++pc; }
+  NEXT;
+jump:
+  pc = code + *pc;
+  NEXT;
+jfalse:
+  if ((--sp)->coerceBool()) ++pc;
+  else pc = code + *pc;
+  NEXT;
+
+read: {
+  int x;
+  resout.flush();
+  *spl.prompt << "read> ";
+  *spl.input >> x;
+  *sp++ = Value(x);
+  NEXT;
+}
+write: {
+  Value v = *--sp;
+  if (!state().error) {
+    v.writeTo(resout);
+    if (*pc) resout << '\n';
+  }
+  ++pc;
+  NEXT;
+}
+writestr:
+  if (!state().error) {
+    resout << cur->strings[pc[0]];
+    if (pc[1]) resout << '\n';
+  }
+  pc += 2;
+  NEXT;
+
+execnode:
+  static_cast<Stmt*>(cur->nodes[*pc++])->exec();
+  NEXT;
+evalnode:
+  *sp++ = static_cast<Exp*>(cur->nodes[*pc++])->eval();
+  NEXT;
+
+pop:
+  --sp;
+  NEXT;
+unset:
+  *sp++ = Value();
+  NEXT;
+call: {
+  Fun** f = spl.funs.find(*pc);
+  if (!f) {
+    errout << "Use of undeclared function " << symbolName(*pc) << '\n';
+    spl.error = true;
+    sp[-1] = Value();
+    ++pc;
+    NEXT;
+  }
+  Bytecode& fbc = (*f)->getBC();
+  size_t used = sp - stack.data();
+  if (used + fbc.maxDepth + 1 > stack.size()) {
+    stack.resize(2 * (used + fbc.maxDepth + 1));
+    sp = stack.data() + used;
+  }
+  returnAddr back = { cur, pc + 1 };
+  calls.push_back(back);
+  spl.enterCall((*f)->getVarSlot(), *--sp);
+  cur = &fbc;
+  code = pc = fbc.start();
+  NEXT;
+}
+ret:
+  spl.leaveCall();
+  cur = calls.back().bc;
+  pc = calls.back().pc;
+  code = cur->start();
+  calls.pop_back();
+  NEXT;
+
+newarr:
+  sp[-1] = NewArray::make(sp[-1].num());
+  NEXT;
+index: {
+  int i = (--sp)->num();
+  int* p = Index::element(sp[-1], i);
+  sp[-1] = p ? Value(*p) : Value();
+  NEXT;
+}
+setelem: {
+  sp -= 3;
+  if (int* p = Index::element(sp[0], sp[1].num())) *p = sp[2].num();
+  NEXT;
+}
+length:
+  sp[-1] = Length::of(sp[-1]);
+  NEXT;
+
+halt:
+  #undef BINARY
+  #undef NEXT
+  return;
+}
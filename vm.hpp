@@ -0,0 +1,128 @@
+/* C++ header file for the bytecode virtual machine.
+ * The interpreter can compile each statement to a compact bytecode and
+ * run that instead of walking the AST. It uses the same variable slots
+ * as the tree walker, which are assigned when the program is parsed.
+ */
+
+#ifndef VM_HPP
+#define VM_HPP
+
+#include <vector>
+using namespace std;
+
+#include "value.hpp"
+
+class AST;
+class Bytecode;
+
+// The instructions, with the operands that follow each in the code.
+// All of them work on a stack of Values.
+enum Opcode {
+  HALT,
+  PUSH,     // n: push the number n
+  PUSHB,    // b: push the boolean b
+  LOAD,     // slot: push a variable's value
+  STORE,    // slot: pop a value into a variable
+  BINDVAR,  // slot: pop a value into a new binding of a variable
+  NEWVAR,   // slot, target: if bound in this scope, fail and jump
+  SETVAR,   // slot, target: unless the variable is bound, fail and jump
+  ENTER,    // start a scope
+  LEAVE,    // end a scope
+  ADDOP, SUBOP, MULOP, DIVOP, MODOP,
+  LTOP, GTOP, LEOP, GEOP, EQOP, NEOP,
+  NEGOP, NOTOP,
+  TRUTH,    // replace the top with its truth value
+  ANDJ,     // target: if the top is false, leave false and jump; else pop
+  ORJ,      // target: if the top is true, leave true and jump; else pop
+  JUMP,     // target
+  JFALSE,   // target: pop, and jump if it is false
+  READOP,   // push a number read from the user
+  WRITEOP,  // newline: pop and write a value
+  WRITESTR, // string, newline: write a string literal
+  EXECNODE, // node: run a statement the VM has no instructions for
+  EVALNODE, // node: push the value of such an expression
+  POP,      // drop the top value
+  UNSET,    // push a Value with nothing in it
+  CALLOP,   // function: pop the argument, call, and push the result
+  RETOP,    // pop the result, and return from the function
+  NEWARR,   // pop a length, and push a new array of that many zeros
+  INDEX,    // pop an index and an array, and push that element of it
+  SETELEM,  // pop a value, an index and an array, and store the value there
+  LENOP,    // replace an array with its length
+  NUMOPS
+};
+
+// How many operands follow each instruction.
+extern const int numOperands[NUMOPS];
+// How many values each instruction takes off the stack, and how
+// that changes the depth of the stack.
+extern const int stackUse[NUMOPS];
+extern const int stackEffect[NUMOPS];
+
+/* Runs bytecode on the variables of the current splContext.
+ * The stacks are kept between runs, to save allocating them each time.
+ */
+class VM {
+  private:
+    vector<Value> stack;
+
+    // Where to go back to when each call in progress returns.
+    struct returnAddr {
+      Bytecode* bc;
+      const int* pc;
+    };
+    vector<returnAddr> calls;
+
+  public:
+    // Runs code that ends in HALT.
+    void run(Bytecode& bc);
+};
+
+/* The code for one top-level statement, as it is being compiled.
+ * The AST it came from must outlive it: string literals, and nodes
+ * that are left to the tree walker, are used from there.
+ */
+class Bytecode {
+  private:
+    int depth;
+
+  public:
+    vector<int> code;
+    vector<const char*> strings;
+    vector<AST*> nodes;
+    int maxDepth;
+    bool inFunction; // whether this is the body of a function
+
+    // Code kept somewhere else, such as a mapped program image, to be
+    // run instead of code. Its strings and nodes are still kept here.
+    const int* mapped;
+
+    Bytecode(bool fn = false)
+      :depth(0), maxDepth(0), inFunction(fn), mapped(NULL) { }
+
+    // The code to run.
+    const int* start() const { return mapped ? mapped : code.data(); }
+
+    // Appends an instruction and its operands. Jump targets may be
+    // filled in later with patch().
+    void emit(Opcode op);
+    void emit(Opcode op, int a) { emit(op); code.push_back(a); }
+    void emit(Opcode op, int a, int b) { emit(op, a); code.push_back(b); }
+
+    // The position the next instruction will have.
+    int here() { return code.size(); }
+
+    // Makes the jump whose target operand is at pos go to here().
+    void patch(int pos) { code[pos] = here(); }
+
+    int addString(const char* s) {
+      strings.push_back(s);
+      return strings.size() - 1;
+    }
+    int addNode(AST* node) {
+      nodes.push_back(node);
+      return nodes.size() - 1;
+    }
+};
+
+#endif // VM_HPP